@@ -10,7 +10,7 @@ struct fadt *fadt;
 
 void *acpi_find_sdt(const char *signature) {
 	if(xsdt != NULL) {
-		for(size_t i = 0; i < (xsdt->acpi_hdr.length - sizeof(struct acpi_hdr)); i++) {
+		for(size_t i = 0; i < (xsdt->acpi_hdr.length - sizeof(struct acpi_hdr)) / sizeof(uint64_t); i++) {
 			struct acpi_hdr *acpi_hdr = (struct acpi_hdr*)(xsdt->acpi_ptr[i] + HIGH_VMA);
 			if(strncmp(acpi_hdr->signature, signature, 4) == 0) {
 				print("acpi: %s found\n", signature);
@@ -20,7 +20,7 @@ void *acpi_find_sdt(const char *signature) {
 	} 
 
 	if(rsdt != NULL) {
-		for(size_t i = 0; i < (rsdt->acpi_hdr.length - sizeof(struct acpi_hdr)); i++) {
+		for(size_t i = 0; i < (rsdt->acpi_hdr.length - sizeof(struct acpi_hdr)) / sizeof(uint32_t); i++) {
 			struct acpi_hdr *acpi_hdr = (struct acpi_hdr*)(rsdt->acpi_ptr[i] + HIGH_VMA);
 			if(strncmp(acpi_hdr->signature, signature, 4) == 0) {
 				print("acpi: %s found\n", signature);
@@ -0,0 +1,160 @@
+#include <acpi/srat.h>
+#include <debug.h>
+#include <string.h>
+#include <cpu.h>
+
+// the pmm consumes this before the slab exists, so everything here lives in fixed size tables
+
+size_t numa_node_cnt = 1;
+size_t numa_range_cnt;
+
+static struct numa_range numa_ranges[NUMA_MAX_RANGES];
+static int numa_apic_nodes[NUMA_MAX_CPUS];
+static uint8_t numa_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static int numa_fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+static int numa_clamp_node(uint32_t proximity) {
+	if(proximity >= NUMA_MAX_NODES) {
+		return 0;
+	}
+
+	if(proximity + 1 > numa_node_cnt) {
+		numa_node_cnt = proximity + 1;
+	}
+
+	return proximity;
+}
+
+static void numa_parse_srat(struct srat_hdr *srat) {
+	for(size_t i = 0; i < srat->acpi_hdr.length - sizeof(struct srat_hdr);) {
+		uint8_t entry_type = srat->entries[i];
+		uint8_t entry_size = srat->entries[i + 1];
+
+		if(entry_size == 0) {
+			break;
+		}
+
+		switch(entry_type) {
+			case 0: {
+				struct srat_ent0 *ent0 = (struct srat_ent0*)&srat->entries[i];
+				if((ent0->flags & 1) == 0) break;
+
+				uint32_t proximity = ent0->proximity_low | ent0->proximity_high[0] << 8 |
+					ent0->proximity_high[1] << 16 | ent0->proximity_high[2] << 24;
+				numa_apic_nodes[ent0->apic_id] = numa_clamp_node(proximity);
+
+				break;
+			}
+			case 1: {
+				struct srat_ent1 *ent1 = (struct srat_ent1*)&srat->entries[i];
+				if((ent1->flags & 1) == 0 || numa_range_cnt == NUMA_MAX_RANGES) break;
+
+				numa_ranges[numa_range_cnt++] = (struct numa_range) {
+					.base = ent1->base,
+					.limit = ent1->base + ent1->length_bytes,
+					.node = numa_clamp_node(ent1->proximity)
+				};
+
+				print("numa: [%x -> %x] node %d\n", ent1->base, ent1->base + ent1->length_bytes, ent1->proximity);
+
+				break;
+			}
+			case 2: {
+				struct srat_ent2 *ent2 = (struct srat_ent2*)&srat->entries[i];
+				if((ent2->flags & 1) == 0 || ent2->x2apic_id >= NUMA_MAX_CPUS) break;
+
+				numa_apic_nodes[ent2->x2apic_id] = numa_clamp_node(ent2->proximity);
+
+				break;
+			}
+		}
+
+		i += entry_size;
+	}
+}
+
+static void numa_parse_slit(struct slit_hdr *slit) {
+	size_t cnt = slit->locality_cnt;
+
+	for(size_t i = 0; i < cnt && i < NUMA_MAX_NODES; i++) {
+		for(size_t j = 0; j < cnt && j < NUMA_MAX_NODES; j++) {
+			numa_distances[i][j] = slit->entries[i * cnt + j];
+		}
+	}
+}
+
+static void numa_build_fallback() {
+	for(size_t node = 0; node < numa_node_cnt; node++) {
+		int *list = numa_fallback[node];
+
+		for(size_t i = 0; i < numa_node_cnt; i++) { // insertion sort by distance, the local node is always the closest
+			size_t j = i;
+
+			while(j > 0 && numa_distances[node][list[j - 1]] > numa_distances[node][i]) {
+				list[j] = list[j - 1];
+				j--;
+			}
+
+			list[j] = i;
+		}
+	}
+}
+
+void numa_init() {
+	for(size_t i = 0; i < NUMA_MAX_NODES; i++) {
+		for(size_t j = 0; j < NUMA_MAX_NODES; j++) {
+			numa_distances[i][j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+		}
+	}
+
+	struct srat_hdr *srat = acpi_find_sdt("SRAT");
+	if(srat) {
+		numa_parse_srat(srat);
+	}
+
+	struct slit_hdr *slit = acpi_find_sdt("SLIT");
+	if(slit) {
+		numa_parse_slit(slit);
+	}
+
+	numa_build_fallback();
+
+	print("numa: %d nodes, %d memory ranges\n", numa_node_cnt, numa_range_cnt);
+}
+
+int numa_apic_node(uint32_t apic_id) {
+	if(apic_id >= NUMA_MAX_CPUS) {
+		return 0;
+	}
+
+	return numa_apic_nodes[apic_id];
+}
+
+int numa_address_node(uint64_t paddr, uint64_t *limit) {
+	uint64_t next = ~0ull;
+
+	for(size_t i = 0; i < numa_range_cnt; i++) {
+		struct numa_range *range = &numa_ranges[i];
+
+		if(range->base <= paddr && range->limit > paddr) {
+			*limit = range->limit;
+			return range->node;
+		}
+
+		if(range->base > paddr && range->base < next) {
+			next = range->base;
+		}
+	}
+
+	*limit = next; // not described by the srat, attribute it to node 0 up to the next described range
+
+	return 0;
+}
+
+int numa_distance(int from, int to) {
+	return numa_distances[from][to];
+}
+
+const int *numa_fallback_list(int node) {
+	return numa_fallback[node];
+}
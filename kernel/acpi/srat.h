@@ -0,0 +1,73 @@
+#pragma once
+
+#include <acpi/rsdp.h>
+#include <types.h>
+
+#define NUMA_MAX_NODES 16
+#define NUMA_MAX_RANGES 64
+#define NUMA_MAX_CPUS 256
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+struct srat_hdr {
+	struct acpi_hdr acpi_hdr;
+	uint32_t reserved0;
+	uint64_t reserved1;
+	uint8_t entries[];
+} __attribute__((packed));
+
+struct srat_ent0 {
+	uint8_t type;
+	uint8_t length;
+	uint8_t proximity_low;
+	uint8_t apic_id;
+	uint32_t flags;
+	uint8_t sapic_eid;
+	uint8_t proximity_high[3];
+	uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_ent1 {
+	uint8_t type;
+	uint8_t length;
+	uint32_t proximity;
+	uint16_t reserved0;
+	uint64_t base;
+	uint64_t length_bytes;
+	uint32_t reserved1;
+	uint32_t flags;
+	uint64_t reserved2;
+} __attribute__((packed));
+
+struct srat_ent2 {
+	uint8_t type;
+	uint8_t length;
+	uint16_t reserved0;
+	uint32_t proximity;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved1;
+} __attribute__((packed));
+
+struct slit_hdr {
+	struct acpi_hdr acpi_hdr;
+	uint64_t locality_cnt;
+	uint8_t entries[];
+} __attribute__((packed));
+
+struct numa_range {
+	uint64_t base;
+	uint64_t limit;
+	int node;
+};
+
+extern size_t numa_node_cnt;
+extern size_t numa_range_cnt;
+
+void numa_init();
+int numa_apic_node(uint32_t apic_id);
+int numa_address_node(uint64_t paddr, uint64_t *limit);
+int numa_distance(int from, int to);
+const int *numa_fallback_list(int node);
@@ -269,17 +269,18 @@ static ssize_t ahci_device_read(struct cdev *cdev, void *buffer, size_t cnt, off
 		return 0;
 	}
 
-	void *lba_buffer = (void*)(pmm_alloc(DIV_ROUNDUP(lba_cnt * AHCI_SECTOR_SIZE, PAGE_SIZE), 1) + HIGH_VMA);
+	void *lba_buffer = (void*)(pmm_alloc_nozero(DIV_ROUNDUP(lba_cnt * AHCI_SECTOR_SIZE, PAGE_SIZE), 1) + HIGH_VMA);
 
 	int bytes_read = ahci_issue_read(device, lba_start, lba_cnt, lba_buffer);
 	if(bytes_read == -1) {
+		pmm_free((uintptr_t)lba_buffer - HIGH_VMA, DIV_ROUNDUP(lba_cnt * AHCI_SECTOR_SIZE, PAGE_SIZE));
 		return -1;
 	}
 
-	pmm_free((uintptr_t)lba_buffer - HIGH_VMA, DIV_ROUNDUP(lba_cnt * AHCI_SECTOR_SIZE, PAGE_SIZE));
-
 	memcpy(buffer, (char*)lba_buffer + (offset % AHCI_SECTOR_SIZE), cnt);
 
+	pmm_free((uintptr_t)lba_buffer - HIGH_VMA, DIV_ROUNDUP(lba_cnt * AHCI_SECTOR_SIZE, PAGE_SIZE));
+
 	return bytes_read - ABS(bytes_read, cnt);
 }
 
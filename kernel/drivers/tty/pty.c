@@ -117,6 +117,7 @@ static int ptmx_open(struct vfs_node*, struct file_handle *file, int) {
 	file->stat = ptm_stat;
 	file->ops = &ptm_ops;
 	file->private_data = ptm_data;
+	vfs_node_put(file->vfs_node); // the handle is the master's from here on, not /dev/ptmx's
 	file->vfs_node = NULL;
 
 	tty_register(makedev(PTS_MAJOR, slave_no), pts_tty);
@@ -171,12 +171,14 @@ int waitq_remove(struct waitq *waitq, struct waitq_trigger *trigger) {
 
 	VECTOR_REMOVE_BY_VALUE(trigger->queues, waitq);
 
-	trigger->refcnt--;
-	if(trigger->refcnt == 0) {
-		free(trigger);
-	}
+	bool last = --trigger->refcnt == 0;
 
 	spinrelease_irqsave(&trigger->lock);
 
+	if(last) {
+		VECTOR_CLEAR(trigger->queues);
+		slab_cache_free(waitq_trigger_cache, trigger);
+	}
+
 	return 0;
 }
@@ -27,7 +27,7 @@ struct waitq {
 };
 
 #define EVENT_DEFAULT_TRIGGER(WAITQ) ({ \
-	struct waitq_trigger *_trigger = alloc(sizeof(struct waitq_trigger)); \
+	struct waitq_trigger *_trigger = slab_cache_alloc(waitq_trigger_cache); \
 	waitq_add(WAITQ, _trigger); \
 	_trigger; \
 })
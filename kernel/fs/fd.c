@@ -10,6 +10,7 @@
 #include <debug.h>
 #include <time.h>
 #include <mm/pmm.h>
+#include <mm/pcache.h>
 #include <fs/cdev.h>
 #include <events/io.h> 
 
@@ -54,7 +55,7 @@ int user_lookup_at(int dirfd, const char *path, int lookup_flags, mode_t mode, s
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -123,10 +124,12 @@ static ssize_t file_read(struct fd_handle *fd_handle, void *buffer, size_t cnt,
 		return 0;
 	}
 
-	ssize_t ret = file->ops->read(file, buffer, cnt, offset);
+	ssize_t ret;
 
-	if(offset + cnt > stat->st_size) {
-		cnt = stat->st_size - offset;
+	if(pcache_enabled(file)) {
+		ret = pcache_read(file, buffer, cnt, offset);
+	} else {
+		ret = file->ops->read(file, buffer, cnt, offset);
 	}
 
 	node_unlock(file->vfs_node);
@@ -142,6 +145,10 @@ static ssize_t file_write(struct fd_handle *fd_handle, const void *buffer, size_
 
 	ssize_t ret = file->ops->write(file, buffer, cnt, offset);
 
+	if(ret > 0 && pcache_enabled(file)) {
+		pcache_write(file, buffer, ret, offset);
+	}
+
 	if(offset + cnt > stat->st_size) {
 		stat->st_size = offset + cnt;
 		stat->st_blocks = DIV_ROUNDUP(stat->st_size, stat->st_blksize);
@@ -424,7 +431,6 @@ int fd_unlinkat(int dirfd, const char *path, int flags) {
 		return -1;
 	}
 
-	vfs_node->fops->unlink(vfs_node);
 	vfs_unlink(vfs_node);
 
 	return 0;
@@ -533,9 +539,11 @@ int fd_openat(int dirfd, const char *path, int flags, mode_t mode) {
 	}
 
 	struct file_ops *fops = vfs_node->fops;
-	struct file_handle *new_file_handle = alloc(sizeof(struct file_handle));
+	struct file_handle *new_file_handle = slab_cache_alloc(file_handle_cache);
 	file_init(new_file_handle);
 	new_file_handle->vfs_node = vfs_node;
+	vfs_node_get(vfs_node);
+
 	new_file_handle->ops = fops;
 	new_file_handle->flags = flags & ~O_CLOEXEC;
 	new_file_handle->stat = vfs_node->stat;
@@ -557,7 +565,7 @@ int fd_openat(int dirfd, const char *path, int flags, mode_t mode) {
 
 	stat_update_time(vfs_node->stat, STAT_ACCESS);
 
-	struct fd_handle *new_fd_handle = alloc(sizeof(struct fd_handle));
+	struct fd_handle *new_fd_handle = slab_cache_alloc(fd_handle_cache);
 	fd_init(new_fd_handle);
 	new_fd_handle->fd_number = bitmap_alloc(&CURRENT_TASK->fd_table->fd_bitmap);
 	new_fd_handle->file_handle = new_file_handle;
@@ -588,7 +596,7 @@ static void fd_close_unlocked(struct fd_handle *handle) {
 	file_put(handle->file_handle);
 	hash_table_delete(&current_task->fd_table->fd_list, &handle->fd_number, sizeof(handle->fd_number));
 	bitmap_free(&current_task->fd_table->fd_bitmap, handle->fd_number);
-	free(handle);
+	slab_cache_free(fd_handle_cache, handle);
 }
 
 int fd_close(int fd) {
@@ -692,7 +700,7 @@ int fd_dup(int fd, bool clear_cloexec) {
 		return -1;
 	}
 
-	struct fd_handle *handle = alloc(sizeof(struct fd_handle));
+	struct fd_handle *handle = slab_cache_alloc(fd_handle_cache);
 	*handle = *fd_handle;
 	handle->fd_number = bitmap_alloc(&current_task->fd_table->fd_bitmap);
 
@@ -724,7 +732,7 @@ int fd_dup2(int oldfd, int newfd) {
 		return newfd;
 	}
 
-	new_handle = alloc(sizeof(struct fd_handle));
+	new_handle = slab_cache_alloc(fd_handle_cache);
 	*new_handle = *oldfd_handle;
 	new_handle->fd_number = newfd;
 	new_handle->flags &= ~FD_CLOEXEC;
@@ -1170,8 +1178,17 @@ void syscall_chdir(struct registers *regs) {
 		return;
 	}
 
+	// a renamed directory stays around for whoever still works in it. an exiting task leaves its
+	// reference be, the pointer is shared with its exec successor and CLONE_FS siblings
+	struct vfs_node *old_cwd = *CURRENT_TASK->cwd;
+
+	vfs_node_get(node);
 	*CURRENT_TASK->cwd = node;
 
+	if(old_cwd) {
+		vfs_node_put(old_cwd);
+	}
+
 	regs->rax = 0;
 }
 
@@ -1190,7 +1207,7 @@ void syscall_mkdirat(struct registers *regs) {
 		return;
 	}
 
-	char *pathname_copy = alloc(strlen(pathname));
+	char *pathname_copy = alloc(strlen(pathname) + 1);
 	strcpy(pathname_copy, pathname);
 
 	while(*pathname_copy == '/') pathname_copy++;
@@ -1249,10 +1266,10 @@ void syscall_pipe(struct registers *regs) {
 
 	print("Returning %d:%d\n", fd_pair[0], fd_pair[1]);
 
-	struct fd_handle *read_fd_handle = alloc(sizeof(struct fd_handle));
-	struct fd_handle *write_fd_handle = alloc(sizeof(struct fd_handle));
-	struct file_handle *read_file_handle = alloc(sizeof(struct file_handle));
-	struct file_handle *write_file_handle = alloc(sizeof(struct file_handle));
+	struct fd_handle *read_fd_handle = slab_cache_alloc(fd_handle_cache);
+	struct fd_handle *write_fd_handle = slab_cache_alloc(fd_handle_cache);
+	struct file_handle *read_file_handle = slab_cache_alloc(file_handle_cache);
+	struct file_handle *write_file_handle = slab_cache_alloc(file_handle_cache);
 
 	fd_init(read_fd_handle);
 	fd_init(write_fd_handle);
@@ -1263,7 +1280,7 @@ void syscall_pipe(struct registers *regs) {
 	*pipe = (struct pipe) {
 		.read = read_file_handle,
 		.write = write_file_handle,
-		.buffer = (void*)(pmm_alloc(DIV_ROUNDUP(PIPE_BUFFER_SIZE, PAGE_SIZE), 1) + HIGH_VMA)
+		.buffer = alloc(PIPE_BUFFER_SIZE)
 	};
 
 	struct file_ops *read_ops = alloc(sizeof(struct file_ops));
@@ -1378,7 +1395,7 @@ void syscall_symlinkat(struct registers *regs) {
 	print("syscall: [pid %x, tid %x] symlinkat: target {%s}, newdirfd {%x}, linkpath {%s}\n", CORE_LOCAL->pid, CORE_LOCAL->tid, target, newdirfd, linkpath);
 #endif
 
-	char *linkpath_copy = alloc(strlen(linkpath));
+	char *linkpath_copy = alloc(strlen(linkpath) + 1);
 	strcpy(linkpath_copy, linkpath);
 
 	while(*linkpath_copy == '/') linkpath_copy++;
@@ -1422,7 +1439,7 @@ void syscall_symlinkat(struct registers *regs) {
 		linkpath_node->stat->st_gid = CURRENT_TASK->effective_gid;
 	}
 
-	char *path = alloc(strlen(target));
+	char *path = alloc(strlen(target) + 1);
 	strcpy(path, target);
 
 	linkpath_node->symlink = path;
@@ -1674,7 +1691,7 @@ void syscall_linkat(struct registers *regs) {
 	print("syscall: [pid %x, tid %x] linkat: olddirfd {%x}, oldpath {%s}, newdirfd {%x}, newpath {%s}, flags {%x}\n", CORE_LOCAL->pid, CORE_LOCAL->tid, olddirfd, oldpath, newdirfd, newpath, flags);
 #endif
 	
-	char *newpath_copy = alloc(strlen(newpath));
+	char *newpath_copy = alloc(strlen(newpath) + 1);
 	strcpy(newpath_copy, newpath);
 
 	while(*newpath_copy == '/') newpath_copy++;
@@ -114,8 +114,11 @@ static inline void file_get(struct file_handle *handle) {
 }
 
 static inline void file_put(struct file_handle *handle) {
-	if (__atomic_sub_fetch(&handle->refcnt, 1, __ATOMIC_RELAXED) == 0)
-		free(handle);
+	if (__atomic_sub_fetch(&handle->refcnt, 1, __ATOMIC_RELAXED) == 0) {
+		if(handle->vfs_node)
+			vfs_node_put(handle->vfs_node);
+		slab_cache_free(file_handle_cache, handle);
+	}
 }
 
 int stat_has_access(struct stat *stat, uid_t uid, gid_t gid, int mode);
@@ -6,9 +6,17 @@
 #include <fs/ramfs.h>
 #include <errno.h>
 #include <sched/sched.h>
+#include <mm/pcache.h>
 
 struct vfs_node *vfs_root;
 
+static struct vfs_node *vfs_alloc_node() {
+	struct vfs_node *node = slab_cache_alloc(vfs_node_cache);
+	node->refcnt = 1;
+
+	return node;
+}
+
 struct vfs_node *vfs_create(struct vfs_node *parent, const char *name, struct stat *stat) {
 	if(parent->mountpoint) {
 		parent = parent->mountpoint;
@@ -30,6 +38,8 @@ int vfs_truncate(struct vfs_node *node, off_t count) {
 		return -1;
 	}
 
+	pcache_truncate(node, count);
+
 	return node->filesystem->truncate(node, count);
 }
 
@@ -80,7 +90,7 @@ struct vfs_node *vfs_create_node(struct vfs_node *parent, struct file_ops *fops,
 		parent = vfs_root;
 	}
 
-	struct vfs_node *node = alloc(sizeof(struct vfs_node));
+	struct vfs_node *node = vfs_alloc_node();
 
 	node->name = name;
 	node->fops = fops;
@@ -93,8 +103,8 @@ struct vfs_node *vfs_create_node(struct vfs_node *parent, struct file_ops *fops,
 	}
 
 	if(S_ISDIR(stat->st_mode)) {
-		struct vfs_node *current_directory = alloc(sizeof(struct vfs_node));
-		struct vfs_node *last_directory = alloc(sizeof(struct vfs_node));
+		struct vfs_node *current_directory = vfs_alloc_node();
+		struct vfs_node *last_directory = vfs_alloc_node();
 
 		current_directory->name = ".";
 		current_directory->stat = stat;
@@ -120,15 +130,15 @@ void vfs_init() {
 	root_stat->st_uid = 0;
 	root_stat->st_gid = 0;
 
-	vfs_root = alloc(sizeof(struct vfs_node));
+	vfs_root = vfs_alloc_node();
 	vfs_root->name = "/";
 	vfs_root->stat = root_stat;
 	vfs_root->filesystem = &ramfs_filesystem;
 	vfs_root->parent = NULL;
 	vfs_root->fops = &ramfs_fops;
 
-	struct vfs_node *current_directory = alloc(sizeof(struct vfs_node));
-	struct vfs_node *last_directory = alloc(sizeof(struct vfs_node));
+	struct vfs_node *current_directory = vfs_alloc_node();
+	struct vfs_node *last_directory = vfs_alloc_node();
 
 	current_directory->name = ".";
 	current_directory->stat = root_stat;
@@ -199,7 +209,7 @@ struct vfs_node *vfs_create_node_deep(struct vfs_node *parent, struct file_ops *
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -255,7 +265,7 @@ struct vfs_node *vfs_search_absolute(struct vfs_node *parent, const char *path,
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc_nozero(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -327,7 +337,7 @@ struct vfs_node *vfs_parent_dir(struct vfs_node *parent, const char *path) {
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -379,11 +389,29 @@ int vfs_mount(struct vfs_node *target, struct stat *stat, struct filesystem *fil
 	return 0;
 }
 
-int vfs_unlink(struct vfs_node *node) {
-	if(node == NULL) { 
-		return -1;
+void vfs_node_get(struct vfs_node *node) {
+	__atomic_add_fetch(&node->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+// an unlinked file lives on for as long as it is open, its data goes with the last reference
+
+void vfs_node_put(struct vfs_node *node) {
+	if(__atomic_sub_fetch(&node->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	pcache_truncate(node, 0);
+
+	if(node->unlinked && node->fops && node->fops->unlink) {
+		node->fops->unlink(node);
 	}
 
+	slab_cache_free(vfs_node_cache, node);
+}
+
+// takes the node out of its directory and drops the reference of the directory entry
+
+static void vfs_detach(struct vfs_node *node) {
 	struct vfs_node *parent = node->parent;
 
 	if(parent == NULL) {
@@ -392,7 +420,16 @@ int vfs_unlink(struct vfs_node *node) {
 
 	VECTOR_REMOVE_BY_VALUE(parent->children, node);
 
-	free(node);
+	vfs_node_put(node);
+}
+
+int vfs_unlink(struct vfs_node *node) {
+	if(node == NULL) { 
+		return -1;
+	}
+
+	node->unlinked = true;
+	vfs_detach(node);
 
 	return 0;
 }
@@ -405,8 +442,8 @@ int vfs_move(struct vfs_node *old, struct vfs_node *new, int keep) {
 
 	new->stat = old->stat;
 
-	if(!keep) {
-		vfs_unlink(old);
+	if(!keep) { // the data now belongs to new
+		vfs_detach(old);
 	}
 
 	return 0;
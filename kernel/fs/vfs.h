@@ -4,6 +4,7 @@
 #include <types.h>
 #include <vector.h>
 #include <hash.h>
+#include <radix.h>
 #include <lock.h>
 
 #define MAX_PATH_LENGTH 4096
@@ -26,10 +27,13 @@ struct vfs_node {
 	VECTOR(struct vfs_node*) children;
 	int refresh;
 
-	struct hash_table shared_pages;
+	struct radix_tree cached_pages; // struct pcache_page by page index
 
 	const char *symlink;
 	struct stat *stat;
+
+	int refcnt; // one for the directory entry, one per file handle and working directory
+	bool unlinked; // fops->unlink runs once the last reference is gone
 };
 
 struct filesystem {
@@ -54,6 +58,8 @@ struct vfs_node *vfs_parent_dir(struct vfs_node *parent, const char *path);
 struct vfs_node *vfs_get_node(struct vfs_node *parent, int index);
 const char *vfs_absolute_path(struct vfs_node *node);
 int vfs_unlink(struct vfs_node *node);
+void vfs_node_get(struct vfs_node *node);
+void vfs_node_put(struct vfs_node *node);
 int vfs_move(struct vfs_node *oldnode, struct vfs_node *new, int keep);
 int vfs_mount(struct vfs_node *target, struct stat *stat, struct filesystem *filesystem, struct file_ops *fops);
 void vfs_init();
@@ -25,6 +25,9 @@ extern void syscall_write(struct registers*);
 extern void syscall_seek(struct registers*);
 extern void syscall_mmap(struct registers*);
 extern void syscall_munmap(struct registers*);
+extern void syscall_mremap(struct registers*);
+extern void syscall_mprotect(struct registers*);
+extern void syscall_memstat(struct registers*);
 extern void syscall_stat(struct registers*);
 extern void syscall_statat(struct registers*);
 extern void syscall_getpid(struct registers*);
@@ -218,7 +221,10 @@ static struct syscall_handle syscall_list[] = {
 	{ .handler = syscall_clock_gettime, .name = "clock_gettime", .class = SYSCALL_TIME }, // 74
 	{ .handler = syscall_linkat, .name = "linkat", .class = SYSCALL_FD }, // 75
 	{ .handler = syscall_getsockopt, .name = "getsockopt", .class = SYSCALL_SOCKET }, // 76
-	{ .handler = syscall_setsockopt, .name = "setsockopt", .class = SYSCALL_SOCKET } // 77
+	{ .handler = syscall_setsockopt, .name = "setsockopt", .class = SYSCALL_SOCKET }, // 77
+	{ .handler = syscall_mremap, .name = "mremap", .class = SYSCALL_MEM }, // 78
+	{ .handler = syscall_mprotect, .name = "mprotect", .class = SYSCALL_MEM }, // 79
+	{ .handler = syscall_memstat, .name = "memstat", .class = SYSCALL_MEM } // 80
 };
 
 extern void syscall_handler(struct registers *regs) {
@@ -1,6 +1,7 @@
 #include <cpu.h>
 
 uint64_t HIGH_VMA = 0xffff800000000000;
+bool cpu_pcid_enabled;
 
 extern void syscall_main();
 
@@ -14,7 +15,7 @@ struct cpuid_state cpuid(size_t leaf, size_t subleaf) {
 		return ret;
 	}
 
-	asm volatile ("cpuid" : "=a"(ret.rax), "=b"(ret.rbx), "=c"(ret.rcx), "=d"(ret.rbx) : "a"(leaf), "c"(subleaf));
+	asm volatile ("cpuid" : "=a"(ret.rax), "=b"(ret.rbx), "=c"(ret.rcx), "=d"(ret.rdx) : "a"(leaf), "c"(subleaf));
 
 	return ret;
 }
@@ -39,6 +40,14 @@ void init_cpu_features() {
 	cr4 |=	(1 << 7) | // Set PGE (allow for global pages)
 			(1 << 9) | // Enables SSE and fxsave/fxrstor
 			(1 << 10); // Enables unmasked SSE exceptions
+
+	uint64_t cr3;
+	asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+
+	if((cpuid(1, 0).rcx & (1 << 17)) && (cr3 & 0xfff) == 0) {
+		cr4 |= (1 << 17); // Set PCIDE (tag tlb entries with the pcid in cr3)
+		cpu_pcid_enabled = true;
+	}
 											
 	asm volatile ("mov %0, %%cr4" :: "r"(cr4));
 
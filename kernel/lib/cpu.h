@@ -166,6 +166,8 @@ static inline uint64_t get_errno() {
 	return CORE_LOCAL->errno;
 }
 
+extern bool cpu_pcid_enabled;
+
 struct cpuid_state cpuid(size_t leaf, size_t subleaf);
 bool get_interrupt_state();
 void init_cpu_features();
@@ -144,6 +144,10 @@ int elf64_file_init(struct elf_file *file) {
 	return 0;
 }
 
+// segments are mapped straight from the file and paged in as they are touched. the last file
+// page is clipped at p_filesz so the start of bss reads as zero, whole bss pages past it are plain
+// anonymous memory
+
 int elf64_file_load(struct elf_file *file) {
 	for(size_t i = 0; i < file->header.ph_num; i++) {
 		if(file->phdr[i].p_type != ELF_PT_LOAD) {
@@ -152,24 +156,39 @@ int elf64_file_load(struct elf_file *file) {
 
 		struct elf64_phdr *phdr = &file->phdr[i];
 
-		size_t misalignment = phdr->p_vaddr & (PAGE_SIZE - 1);
-		size_t page_cnt = DIV_ROUNDUP(misalignment + phdr->p_memsz, PAGE_SIZE);
+		uintptr_t vaddr = phdr->p_vaddr + file->load_offset;
+		size_t misalignment = vaddr & (PAGE_SIZE - 1);
+
+		uintptr_t base = vaddr - misalignment;
+		uintptr_t file_end = ALIGN_UP(vaddr + phdr->p_filesz, PAGE_SIZE);
+		uintptr_t mem_end = ALIGN_UP(vaddr + phdr->p_memsz, PAGE_SIZE);
+
+		int prot = MMAP_PROT_READ | MMAP_PROT_USER;
+
+		if(phdr->p_flags & ELF_PF_W) prot |= MMAP_PROT_WRITE;
+		if(phdr->p_flags & ELF_PF_X) prot |= MMAP_PROT_EXEC;
 
-		if((misalignment + phdr->p_memsz) > PAGE_SIZE) {
-			page_cnt++;
+		uintptr_t anon_base = base;
+
+		if(phdr->p_filesz) {
+			void *ret = mmap(file->page_table, (void*)base, file_end - base, prot,
+				MMAP_MAP_FIXED | MMAP_MAP_PRIVATE, file->fd, phdr->p_offset - misalignment);
+			if(ret == MMAP_MAP_FAILED) {
+				return -1;
+			}
+
+			mmap_region_search(file->page_table, base)->file_size = misalignment + phdr->p_filesz;
+
+			anon_base = file_end;
 		}
 
-		mmap(
-			file->page_table,
-			(void*)(phdr->p_vaddr + file->load_offset - misalignment),
-			page_cnt * PAGE_SIZE,
-			MMAP_PROT_READ | MMAP_PROT_WRITE | MMAP_PROT_EXEC | MMAP_PROT_USER,
-			MMAP_MAP_FIXED | MMAP_MAP_ANONYMOUS,
-			-1,
-			-1
-		);
-
-		file->read(file, (void*)(phdr->p_vaddr + file->load_offset), phdr->p_offset, phdr->p_filesz);
+		if(mem_end > anon_base) {
+			void *ret = mmap(file->page_table, (void*)anon_base, mem_end - anon_base, prot,
+				MMAP_MAP_FIXED | MMAP_MAP_PRIVATE | MMAP_MAP_ANONYMOUS, -1, 0);
+			if(ret == MMAP_MAP_FAILED) {
+				return -1;
+			}
+		}
 	}
 
 	return 0;
@@ -1,6 +1,6 @@
 #include <hash.h>
 #include <string.h>
-#include <mm/pmm.h>
+#include <mm/slab.h>
 #include <cpu.h>
 
 uint64_t fnv_hash(char *data, size_t byte_cnt) {
@@ -36,8 +36,8 @@ void hash_table_push(struct hash_table *table, void *key, void *data, size_t key
 	if(table->capacity == 0) {
 		table->capacity = 16;
 
-		table->data = (void*)(pmm_alloc(DIV_ROUNDUP(table->capacity * sizeof(void*), PAGE_SIZE), 1) + HIGH_VMA);
-		table->keys = (void*)(pmm_alloc(DIV_ROUNDUP(table->capacity * sizeof(void*), PAGE_SIZE), 1) + HIGH_VMA);
+		table->data = alloc(table->capacity * sizeof(void*));
+		table->keys = alloc(table->capacity * sizeof(void*));
 	}
 
 	uint64_t hash = fnv_hash(key, key_size);
@@ -46,7 +46,7 @@ void hash_table_push(struct hash_table *table, void *key, void *data, size_t key
 
 	for(; index < table->capacity; index++) {
 		if(table->keys[index] == NULL || memcmp(table->keys[index], key, key_size) == 0) {
-			void *key_copy = alloc(key_size);
+			void *key_copy = alloc_nozero(key_size);
 			memcpy(key_copy, key, key_size);
 			table->keys[index] = key_copy;
 			table->data[index] = data;
@@ -58,8 +58,8 @@ void hash_table_push(struct hash_table *table, void *key, void *data, size_t key
 	struct hash_table expanded_table = {
 		.capacity = table->capacity * 2,
 		.element_cnt = 0,
-		.data = (void*)(pmm_alloc(DIV_ROUNDUP(table->capacity * sizeof(void*) * 2, PAGE_SIZE), 1) + HIGH_VMA),
-		.keys = (void*)(pmm_alloc(DIV_ROUNDUP(table->capacity * sizeof(void*) * 2, PAGE_SIZE), 1) + HIGH_VMA)
+		.data = alloc(table->capacity * sizeof(void*) * 2),
+		.keys = alloc(table->capacity * sizeof(void*) * 2)
 	};
 
 	for(size_t i = 0; i < table->capacity; i++) {
@@ -68,8 +68,8 @@ void hash_table_push(struct hash_table *table, void *key, void *data, size_t key
 		}
 	}
 
-	pmm_free((uintptr_t)table->keys - HIGH_VMA, DIV_ROUNDUP(table->capacity * sizeof(void*), PAGE_SIZE));
-	pmm_free((uintptr_t)table->data - HIGH_VMA, DIV_ROUNDUP(table->capacity * sizeof(void*), PAGE_SIZE));
+	free(table->keys);
+	free(table->data);
 
 	hash_table_push(&expanded_table, key, data, key_size);
 	*table = expanded_table;
@@ -7,8 +7,13 @@ struct spinlock {
 	bool interrupts;
 };
 
+void tlb_poll();
+
+// the holder may have interrupts off and be waiting for this cpu to answer a tlb shootdown
 static inline void raw_spinlock(void *lock) {
-	while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE));
+	while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+		tlb_poll();
+	}
 }
 
 static inline void raw_spinrelease(void *lock) {
@@ -40,3 +45,20 @@ static inline void spinrelease_irqsave(struct spinlock *spinlock) {
 		asm volatile ("cli");
 	}
 }
+
+static inline bool spintrylock_irqsave(struct spinlock *spinlock) {
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
+
+	if(__atomic_test_and_set(&spinlock->lock, __ATOMIC_ACQUIRE)) {
+		if(interrupts) {
+			asm volatile ("sti");
+		}
+
+		return false;
+	}
+
+	spinlock->interrupts = interrupts;
+
+	return true;
+}
@@ -0,0 +1,159 @@
+#include <radix.h>
+#include <mm/slab.h>
+
+#define RADIX_TREE_MAX_HEIGHT ((64 + RADIX_TREE_SHIFT - 1) / RADIX_TREE_SHIFT)
+
+static bool radix_tree_covers(struct radix_tree *tree, uint64_t index) {
+	if(tree->height == 0) {
+		return false;
+	}
+
+	size_t bits = tree->height * RADIX_TREE_SHIFT;
+
+	return bits >= 64 || (index >> bits) == 0;
+}
+
+void *radix_tree_search(struct radix_tree *tree, uint64_t index) {
+	if(!radix_tree_covers(tree, index)) {
+		return NULL;
+	}
+
+	struct radix_node *node = tree->root;
+
+	for(int level = tree->height - 1; level > 0; level--) {
+		node = node->slots[(index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK];
+		if(node == NULL) {
+			return NULL;
+		}
+	}
+
+	return node->slots[index & RADIX_TREE_MASK];
+}
+
+void radix_tree_insert(struct radix_tree *tree, uint64_t index, void *data) {
+	if(data == NULL) {
+		radix_tree_delete(tree, index);
+		return;
+	}
+
+	while(!radix_tree_covers(tree, index)) { // grow at the top, the old root becomes slot 0
+		struct radix_node *node = slab_cache_alloc(radix_node_cache);
+
+		if(tree->root) {
+			node->slots[0] = tree->root;
+			node->present = 1;
+		}
+
+		tree->root = node;
+		tree->height++;
+	}
+
+	struct radix_node *node = tree->root;
+
+	for(int level = tree->height - 1; level > 0; level--) {
+		size_t slot = (index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK;
+
+		if(node->slots[slot] == NULL) {
+			node->slots[slot] = slab_cache_alloc(radix_node_cache);
+			node->present |= 1ull << slot;
+		}
+
+		node = node->slots[slot];
+	}
+
+	size_t slot = index & RADIX_TREE_MASK;
+
+	if(node->slots[slot] == NULL) {
+		node->present |= 1ull << slot;
+		tree->element_cnt++;
+	}
+
+	node->slots[slot] = data;
+}
+
+void *radix_tree_delete(struct radix_tree *tree, uint64_t index) {
+	if(!radix_tree_covers(tree, index)) {
+		return NULL;
+	}
+
+	struct radix_node *path[RADIX_TREE_MAX_HEIGHT];
+	struct radix_node *node = tree->root;
+
+	for(int level = tree->height - 1; level > 0; level--) {
+		path[level] = node;
+
+		node = node->slots[(index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK];
+		if(node == NULL) {
+			return NULL;
+		}
+	}
+
+	size_t slot = index & RADIX_TREE_MASK;
+
+	void *data = node->slots[slot];
+	if(data == NULL) {
+		return NULL;
+	}
+
+	node->slots[slot] = NULL;
+	node->present &= ~(1ull << slot);
+	tree->element_cnt--;
+
+	// empty nodes are released bottom up
+	for(int level = 1; node->present == 0; level++) {
+		slab_cache_free(radix_node_cache, node);
+
+		if(level == tree->height) {
+			tree->root = NULL;
+			tree->height = 0;
+			break;
+		}
+
+		node = path[level];
+		slot = (index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK;
+
+		node->slots[slot] = NULL;
+		node->present &= ~(1ull << slot);
+	}
+
+	return data;
+}
+
+static void *radix_node_next(struct radix_node *node, int level, uint64_t *index) {
+	size_t shift = level * RADIX_TREE_SHIFT;
+	size_t slot = (*index >> shift) & RADIX_TREE_MASK;
+	uint64_t present = node->present & (~0ull << slot);
+
+	while(present) {
+		size_t i = __builtin_ctzll(present);
+
+		if(i != slot) { // skipped ahead, the lower key bits start over
+			*index &= ~(((uint64_t)RADIX_TREE_MASK << shift) | ((1ull << shift) - 1));
+			*index |= (uint64_t)i << shift;
+		}
+
+		if(level == 0) {
+			return node->slots[i];
+		}
+
+		void *data = radix_node_next(node->slots[i], level - 1, index);
+		if(data) {
+			return data;
+		}
+
+		present &= present - 1;
+	}
+
+	return NULL;
+}
+
+// finds the entry with the smallest key not below *index and stores that key in *index, walking
+// only the populated parts of the tree
+
+void *radix_tree_next(struct radix_tree *tree, uint64_t *index) {
+	if(!radix_tree_covers(tree, *index)) {
+		return NULL;
+	}
+
+	return radix_node_next(tree->root, tree->height - 1, index);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <types.h>
+
+#define RADIX_TREE_SHIFT 6
+#define RADIX_TREE_SLOTS (1 << RADIX_TREE_SHIFT)
+#define RADIX_TREE_MASK (RADIX_TREE_SLOTS - 1)
+
+struct radix_node {
+	uint64_t present; // one bit per occupied slot
+	void *slots[RADIX_TREE_SLOTS];
+};
+
+struct radix_tree {
+	struct radix_node *root;
+	int height; // the tree covers keys below 1 << (height * RADIX_TREE_SHIFT)
+	size_t element_cnt;
+};
+
+void *radix_tree_search(struct radix_tree *tree, uint64_t index);
+void radix_tree_insert(struct radix_tree *tree, uint64_t index, void *data);
+void *radix_tree_delete(struct radix_tree *tree, uint64_t index);
+void *radix_tree_next(struct radix_tree *tree, uint64_t *index);
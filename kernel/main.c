@@ -5,6 +5,7 @@
 #include <mm/vmm.h>
 #include <mm/mmap.h>
 #include <mm/slab.h>
+#include <mm/tlb.h>
 #include <int/apic.h>
 #include <int/gdt.h>
 #include <int/idt.h>
@@ -85,7 +86,7 @@ void init_process() {
 		.argv_cnt = 1
 	};
 
-	struct task *task = alloc(sizeof(struct task));
+	struct task *task = slab_cache_alloc(task_cache);
 	sched_default_task(task, CURRENT_TASK->namespace, 1);
 
 	int ret = sched_load_program(task, argv[0]);
@@ -160,22 +161,19 @@ void pastoral_entry(void) {
 
 	init_cpu_features();
 
+	rsdp = limine_rsdp_request.response->address;
+
+	if(rsdp->xsdt_addr) {
+		xsdt = (struct xsdt*)(rsdp->xsdt_addr + HIGH_VMA);
+		print("acpi: xsdt found at %x\n", (uintptr_t)xsdt);
+	} else {
+		rsdt = (struct rsdt*)(rsdp->rsdt_addr + HIGH_VMA);
+		print("acpi: rsdt found at %x\n", (uintptr_t)rsdt);
+	}
+
 	pmm_init();
 
-	slab_cache_create(NULL, 32);
-	slab_cache_create(NULL, 64);
-	slab_cache_create(NULL, 128);
-	slab_cache_create(NULL, 256);
-	slab_cache_create(NULL, 512);
-	slab_cache_create(NULL, 1024);
-	slab_cache_create(NULL, 2048);
-	slab_cache_create(NULL, 4096);
-	slab_cache_create(NULL, 8192);
-	slab_cache_create(NULL, 16384);
-	slab_cache_create(NULL, 32768);
-	slab_cache_create(NULL, 65536);
-	slab_cache_create(NULL, 131072);
-	slab_cache_create(NULL, 262144);
+	slab_init();
 
 	vmm_init();
 
@@ -187,22 +185,13 @@ void pastoral_entry(void) {
 		panic("could not parse kernel file");
 	}
 
-	rsdp = limine_rsdp_request.response->address;
-
-	if(rsdp->xsdt_addr) {
-		xsdt = (struct xsdt*)(rsdp->xsdt_addr + HIGH_VMA);
-		print("acpi: xsdt found at %x\n", (uintptr_t)xsdt);
-	} else {
-		rsdt = (struct rsdt*)(rsdp->rsdt_addr + HIGH_VMA);
-		print("acpi: rsdt found at %x\n", (uintptr_t)rsdt);
-	}
-
 	fadt = acpi_find_sdt("FACP");
 
 	vfs_init();
 
 	hpet_init();
 	apic_init();
+	tlb_init();
 	boot_aps();
 	pci_init();
 	pit_init();
@@ -210,7 +199,7 @@ void pastoral_entry(void) {
 	apic_timer_init(20);
 
 	struct pid_namespace *namespace = sched_default_namespace();
-	struct task *kernel_task = alloc(sizeof(struct task));
+	struct task *kernel_task = slab_cache_alloc(task_cache);
 	sched_default_task(kernel_task, namespace, 1);
 
 	kernel_task->regs.cs = 0x28;
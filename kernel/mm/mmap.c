@@ -4,163 +4,308 @@
 #include <sched/sched.h>
 #include <debug.h>
 #include <errno.h>
-#include <bst.h>
 #include <string.h>
 #include <fs/vfs.h>
 #include <mm/pmm.h>
+#include <mm/tlb.h>
+#include <mm/pcache.h>
+#include <mm/vmalloc.h>
+#include <mm/slab.h>
+#include <mm/swap.h>
+
+// regions sit in an avl tree ordered by base. every node also knows the span of its subtree and
+// the largest unmapped gap inside that span, which is enough to find the lowest fitting hole
+// without looking at subtrees that cannot hold it
+
+static int mmap_region_height(struct mmap_region *region) {
+	return region ? region->height : 0;
+}
 
-static ssize_t validate_region(struct page_table *page_table, uint64_t base, uint64_t length) {
-	struct mmap_region *root = page_table->mmap_region_root;
+static void mmap_region_update(struct mmap_region *region) {
+	struct mmap_region *left = region->left;
+	struct mmap_region *right = region->right;
 
-	if(root == NULL) {
-		return -1;
+	int left_height = mmap_region_height(left);
+	int right_height = mmap_region_height(right);
+
+	region->height = 1 + (left_height > right_height ? left_height : right_height);
+	region->subtree_base = left ? left->subtree_base : region->base;
+	region->subtree_end = right ? right->subtree_end : region->base + region->limit;
+	region->max_gap = 0;
+
+	if(left) {
+		size_t gap = region->base - left->subtree_end;
+		region->max_gap = left->max_gap > gap ? left->max_gap : gap;
 	}
 
-	while(root) {
-		if(root->base <= base && (root->base + root->limit) > base) {
-			return root->base + root->limit - base + length;
+	if(right) {
+		size_t gap = right->subtree_base - (region->base + region->limit);
+		if(gap > region->max_gap) region->max_gap = gap;
+		if(right->max_gap > region->max_gap) region->max_gap = right->max_gap;
+	}
+}
+
+static struct mmap_region *mmap_region_rotate_left(struct mmap_region *region) {
+	struct mmap_region *pivot = region->right;
+
+	region->right = pivot->left;
+	pivot->left = region;
+
+	mmap_region_update(region);
+	mmap_region_update(pivot);
+
+	return pivot;
+}
+
+static struct mmap_region *mmap_region_rotate_right(struct mmap_region *region) {
+	struct mmap_region *pivot = region->left;
+
+	region->left = pivot->right;
+	pivot->right = region;
+
+	mmap_region_update(region);
+	mmap_region_update(pivot);
+
+	return pivot;
+}
+
+static struct mmap_region *mmap_region_balance(struct mmap_region *region) {
+	mmap_region_update(region);
+
+	int balance = mmap_region_height(region->left) - mmap_region_height(region->right);
+
+	if(balance > 1) {
+		if(mmap_region_height(region->left->left) < mmap_region_height(region->left->right)) {
+			region->left = mmap_region_rotate_left(region->left);
 		}
+		return mmap_region_rotate_right(region);
+	}
 
-		if(root->base > base) {
-			root = root->left;
+	if(balance < -1) {
+		if(mmap_region_height(region->right->right) < mmap_region_height(region->right->left)) {
+			region->right = mmap_region_rotate_right(region->right);
+		}
+		return mmap_region_rotate_left(region);
+	}
+
+	return region;
+}
+
+static struct mmap_region *mmap_region_link(struct mmap_region *root, struct mmap_region *region) {
+	if(root == NULL) {
+		region->left = NULL;
+		region->right = NULL;
+		mmap_region_update(region);
+		return region;
+	}
+
+	if(region->base < root->base) {
+		root->left = mmap_region_link(root->left, region);
+	} else {
+		root->right = mmap_region_link(root->right, region);
+	}
+
+	return mmap_region_balance(root);
+}
+
+static struct mmap_region *mmap_region_unlink_min(struct mmap_region *root, struct mmap_region **min) {
+	if(root->left == NULL) {
+		*min = root;
+		return root->right;
+	}
+
+	root->left = mmap_region_unlink_min(root->left, min);
+
+	return mmap_region_balance(root);
+}
+
+static struct mmap_region *mmap_region_unlink(struct mmap_region *root, struct mmap_region *region) {
+	if(root == NULL) {
+		return NULL;
+	}
+
+	if(root != region) {
+		if(region->base < root->base) {
+			root->left = mmap_region_unlink(root->left, region);
 		} else {
-			root = root->right;
+			root->right = mmap_region_unlink(root->right, region);
 		}
+
+		return mmap_region_balance(root);
+	}
+
+	if(root->left == NULL || root->right == NULL) {
+		return root->left ? root->left : root->right;
 	}
 
-	return -1;
+	struct mmap_region *successor;
+	struct mmap_region *right = mmap_region_unlink_min(root->right, &successor);
+
+	successor->left = root->left;
+	successor->right = right;
+
+	return mmap_region_balance(successor);
+}
+
+void mmap_region_insert(struct page_table *page_table, struct mmap_region *region) {
+	page_table->mmap_region_root = mmap_region_link(page_table->mmap_region_root, region);
+}
+
+void mmap_region_delete(struct page_table *page_table, struct mmap_region *region) {
+	page_table->mmap_region_root = mmap_region_unlink(page_table->mmap_region_root, region);
 }
 
-static struct mmap_region *mmap_search_region(struct page_table *page_table, uint64_t base) {
+struct mmap_region *mmap_region_search(struct page_table *page_table, uintptr_t addr) {
 	struct mmap_region *root = page_table->mmap_region_root;
 
 	while(root) {
-		if(root->base <= base && (root->base + root->limit) >= base) {
+		if(addr < root->base) {
+			root = root->left;
+		} else if(addr >= root->base + root->limit) {
+			root = root->right;
+		} else {
 			break;
 		}
+	}
 
-		if(root->base > base) {
+	return root;
+}
+
+// lowest region that ends above addr
+static struct mmap_region *mmap_region_next(struct page_table *page_table, uintptr_t addr) {
+	struct mmap_region *root = page_table->mmap_region_root;
+	struct mmap_region *ret = NULL;
+
+	while(root) {
+		if(root->base + root->limit > addr) {
+			ret = root;
 			root = root->left;
 		} else {
 			root = root->right;
 		}
 	}
 
-	return root;
+	return ret;
 }
 
-static int mmap_shared_pages(struct page_table *page_table, uintptr_t vaddr, int fd, off_t offset, int length, int prot) {
-	print("SHARED PAGES!!!!\n");
-	struct fd_handle *handle = fd_translate(fd);
-	if(handle == NULL) {
-		set_errno(EBADF);
-		return -1;
+// lowest hole of length bytes not below floor that lies inside the span of the subtree, 0 if none
+static uintptr_t mmap_region_gap(struct mmap_region *region, uintptr_t floor, size_t length) {
+	if(region == NULL || region->max_gap < length || region->subtree_end < floor + length) {
+		return 0;
 	}
 
-	file_get(handle->file_handle);
+	uintptr_t end = region->base + region->limit;
+
+	if(region->left) {
+		uintptr_t ret = mmap_region_gap(region->left, floor, length);
+		if(ret) {
+			return ret;
+		}
+
+		uintptr_t start = region->left->subtree_end > floor ? region->left->subtree_end : floor;
+		if(region->base >= start + length) {
+			return start;
+		}
+	}
+
+	if(region->right) {
+		uintptr_t start = end > floor ? end : floor;
+		if(region->right->subtree_base >= start + length) {
+			return start;
+		}
+
+		return mmap_region_gap(region->right, floor, length);
+	}
+
+	return 0;
+}
+
+// 0 when no hole of length bytes is left below MMAP_MAP_MAX_ADDR
+
+static uintptr_t mmap_find_space(struct page_table *page_table, size_t length) {
+	struct mmap_region *root = page_table->mmap_region_root;
+	uintptr_t floor = page_table->mmap_min_addr;
+
+	if(length > MMAP_MAP_MAX_ADDR - floor) {
+		return 0;
+	}
+
+	if(root == NULL || root->subtree_base >= floor + length) {
+		return floor;
+	}
+
+	uintptr_t base = mmap_region_gap(root, floor, length);
+	if(base == 0) {
+		base = root->subtree_end > floor ? root->subtree_end : floor;
+	}
+
+	return base <= MMAP_MAP_MAX_ADDR - length ? base : 0;
+}
+
+// device memory comes with frames of its own (see ops->shared) and is mapped whole right away
+
+static void mmap_shared_pages(struct page_table *page_table, uintptr_t vaddr, struct file_handle *file, off_t offset, size_t length, int prot) {
 	offset = offset & ~(0xfff);
 
-	uint64_t flags = VMM_FILE_FLAG | VMM_SHARE_FLAG | VMM_FLAGS_NX;
+	uint64_t flags = VMM_FLAGS_P | VMM_FILE_FLAG | VMM_SHARE_FLAG | VMM_FLAGS_NX;
 
 	if(prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
 	if(prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
 	if(prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
 
-	for(size_t i = 0; i < DIV_ROUNDUP(length, PAGE_SIZE); i++) {
-		struct page *page = hash_table_search(&handle->file_handle->vfs_node->shared_pages, &offset, sizeof(offset));
-		struct page *new_page = alloc(sizeof(struct page));
+	uint64_t frames[VMM_MAP_BATCH];
+	size_t page_cnt = DIV_ROUNDUP(length, PAGE_SIZE);
 
-		if(page) {
-			flags |= VMM_FLAGS_P;
+	while(page_cnt) { // a 2MiB block at a time
+		size_t index = (vaddr >> 12) & 0x1ff;
+		size_t cnt = VMM_MAP_BATCH - index < page_cnt ? VMM_MAP_BATCH - index : page_cnt;
 
-			*new_page = (struct page) {
-				.vaddr = vaddr,
-				.frame = page->frame,
-				.size = PAGE_SIZE,
-				.flags = flags,
-				.offset = offset,
-				.pml_entry = page_table->map_page(page_table, vaddr, page->frame->addr, flags),
-				.reference = page->reference
-			};
+		for(size_t i = 0; i < cnt; i++) {
+			frames[i] = (uint64_t)file->ops->shared(file, NULL, offset + i * PAGE_SIZE);
+		}
 
-			(*new_page->reference)++;
-		} else {
-			struct frame *frame = alloc(sizeof(struct frame));
-			uint64_t extra_flags = 0;
-
-			if(handle->file_handle->ops->shared == NULL) {
-				frame->addr = pmm_alloc(1, 1);
-			} else {
-				frame->addr = (uint64_t)handle->file_handle->ops->shared(handle->file_handle, NULL, offset);
-				extra_flags |= VMM_FLAGS_P;
-			}
+		uint64_t *entry = vmm_map_pages(page_table, vaddr, frames, cnt, flags);
+
+		for(size_t i = 0; i < cnt; i++) {
+			struct frame *frame = slab_cache_alloc(frame_cache);
+			frame->addr = frames[i];
+
+			struct page *new_page = slab_cache_alloc_nozero(page_cache);
 
 			*new_page = (struct page) {
-				.vaddr = vaddr,
+				.vaddr = vaddr + i * PAGE_SIZE,
 				.frame = frame,
 				.size = PAGE_SIZE,
-				.flags = flags | extra_flags,
-				.file = handle->file_handle,
-				.offset = offset,
-				.pml_entry = page_table->map_page(page_table, vaddr, frame->addr, flags | extra_flags),
+				.flags = flags,
+				.offset = offset + i * PAGE_SIZE,
+				.pml_entry = entry + i,
 				.reference = alloc(sizeof(int))
 			};
 
 			(*new_page->reference) = 1;
-		}
 
-		hash_table_push(page_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
-		hash_table_push(&handle->file_handle->vfs_node->shared_pages, &new_page->offset, new_page, sizeof(new_page->vaddr));
+			vmm_page_insert(page_table, new_page);
+		}
 
-		offset += PAGE_SIZE;
-		vaddr += PAGE_SIZE;
+		offset += cnt * PAGE_SIZE;
+		vaddr += cnt * PAGE_SIZE;
+		page_cnt -= cnt;
 	}
-
-	return 0;
 }
 
-static int mmap_private_pages(struct page_table *page_table, uintptr_t vaddr, int fd, off_t offset, int length, int prot) {
+// a file mapping only holds on to the file, pages come out of the page cache as they are
+// touched (see vmm_file_map)
+
+static struct file_handle *mmap_file(int fd) {
 	struct fd_handle *handle = fd_translate(fd);
 	if(handle == NULL) {
 		set_errno(EBADF);
-		return -1;
+		return NULL;
 	}
 
 	file_get(handle->file_handle);
-	offset = offset & ~(0xfff);
 
-	uint64_t flags = VMM_FILE_FLAG | VMM_FLAGS_NX;
-
-	if(prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
-	if(prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
-	if(prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
-
-	for(size_t i = 0; i < DIV_ROUNDUP(length, PAGE_SIZE); i++) {
-		struct page *page = alloc(sizeof(struct page));
-
-		struct frame *frame = alloc(sizeof(struct frame));
-		frame->addr = pmm_alloc(1, 1);
-
-		*page = (struct page) {
-			.vaddr = vaddr,
-			.frame = frame,
-			.size = PAGE_SIZE,
-			.flags = flags,
-			.file = handle->file_handle,
-			.offset = offset,
-			.pml_entry = page_table->map_page(page_table, vaddr, frame->addr, flags),
-			.reference = alloc(sizeof(int))
-		};
-
-		(*page->reference) = 1;
-
-		hash_table_push(page_table->pages, &page->vaddr, page, sizeof(page->vaddr));
-
-		offset += PAGE_SIZE;
-		vaddr += PAGE_SIZE;
-	}
-
-	return 0;
+	return handle->file_handle;
 }
 
 void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
@@ -171,20 +316,12 @@ void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, i
 	if(flags & MMAP_MAP_FIXED) {
 		base = (uintptr_t)addr;
 	} else {
-		base = page_table->mmap_bump_base;
-
-		for(;;) {
-			ssize_t conflict_offset = validate_region(page_table, base, length);
+		base = mmap_find_space(page_table, length);
 
-			if(conflict_offset == -1) {
-				break;
-			}
-
-			base += conflict_offset;
+		if(length && base == 0) {
+			set_errno(ENOMEM);
+			return (void*)-1;
 		}
-
-		page_table->mmap_bump_base = base;
-		page_table->mmap_bump_base += length;
 	}
 
 	if(length == 0 || base == 0) {
@@ -197,19 +334,32 @@ void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, i
 		return (void*)-1;
 	}
 
+	if(flags & MMAP_MAP_FIXED) { // a fixed mapping replaces whatever was there
+		munmap(page_table, (void*)base, length);
+	}
+
+	struct file_handle *file = NULL;
+
 	if(!(flags & MMAP_MAP_ANONYMOUS)) {
-		if(flags & MMAP_MAP_SHARED) {
-			if(mmap_shared_pages(page_table, base, fd, offset, length, prot) == -1) {
-				return (void*)-1;
-			}
-		} else if(flags & MMAP_MAP_PRIVATE) {
-			if(mmap_private_pages(page_table, base, fd, offset, length, prot) == -1) {
-				return (void*)-1;
-			}
-		} else {
+		if(!(flags & (MMAP_MAP_SHARED | MMAP_MAP_PRIVATE))) {
 			set_errno(EINVAL);
 			return (void*)-1;
 		}
+
+		file = mmap_file(fd);
+		if(file == NULL) {
+			return (void*)-1;
+		}
+
+		if((flags & MMAP_MAP_SHARED) && file->ops->shared) {
+			mmap_shared_pages(page_table, base, file, offset, length, prot);
+			file_put(file);
+			file = NULL;
+		} else if((flags & MMAP_MAP_SHARED) && !pcache_enabled(file)) {
+			file_put(file);
+			set_errno(ENODEV);
+			return (void*)-1;
+		}
 	}
 
 	struct mmap_region *region = alloc(sizeof(struct mmap_region));
@@ -220,40 +370,78 @@ void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, i
 		.prot = prot,
 		.flags = flags,
 		.fd = fd,
-		.offset = offset
+		.offset = offset,
+		.file = file,
+		.file_size = file ? length : 0
 	};
 
-	BST_GENERIC_INSERT(page_table->mmap_region_root, base, region);
+	mmap_region_insert(page_table, region);
 
-/*	uint64_t _flags = VMM_FLAGS_P | VMM_FLAGS_NX;
+	if(flags & MMAP_MAP_POPULATE) {
+		vmm_populate(page_table, base, length);
+	}
 
-	if(prot & MMAP_PROT_WRITE) _flags |= VMM_FLAGS_RW;
-	if(prot & MMAP_PROT_USER) _flags |= VMM_FLAGS_US;
-	if(prot & MMAP_PROT_EXEC) _flags &= ~(VMM_FLAGS_NX);
-	if(prot & MMAP_PROT_NONE) _flags &= ~(VMM_FLAGS_P);
+	return (void*)base;
+}
 
-	for(size_t i = 0; i < DIV_ROUNDUP(length, PAGE_SIZE); i++) {
-		uint64_t paddr = pmm_alloc(1, 1);
-		uint64_t vaddr = base;
 
-		struct page *new_page = alloc(sizeof(struct page));
-		*new_page = (struct page) {
-			.vaddr = vaddr,
-			.paddr = paddr,
-			.size = PAGE_SIZE,
-			.flags = _flags,
-			.pml_entry = page_table->map_page(page_table, vaddr, paddr, _flags),
-			.reference = alloc(sizeof(int))
-		};
+// the region around addr becomes two regions meeting at addr
 
-		(*new_page->reference) = 1;
+static void mmap_region_split(struct page_table *page_table, uintptr_t addr) {
+	struct mmap_region *region = mmap_region_search(page_table, addr);
+	if(region == NULL || region->base == addr) {
+		return;
+	}
 
-		hash_table_push(page_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
-	}*/
+	size_t lower_limit = addr - region->base;
 
-	return (void*)base;
+	mmap_region_delete(page_table, region);
+
+	struct mmap_region *upper_split = alloc(sizeof(struct mmap_region));
+
+	*upper_split = *region;
+	upper_split->base = addr;
+	upper_split->limit = region->limit - lower_limit;
+	upper_split->offset = region->offset + lower_limit;
+	upper_split->file_size = region->file_size > lower_limit ? region->file_size - lower_limit : 0;
+
+	if(upper_split->file) {
+		file_get(upper_split->file);
+	}
+
+	region->limit = lower_limit;
+
+	if(region->file_size > region->limit) {
+		region->file_size = region->limit;
+	}
+
+	mmap_region_insert(page_table, region);
+	mmap_region_insert(page_table, upper_split);
+}
+
+// every region overlapping the range is cut down to the parts outside of it
+
+static void mmap_region_cut(struct page_table *page_table, uintptr_t base, uintptr_t limit) {
+	struct mmap_region *region;
+
+	mmap_region_split(page_table, base);
+	mmap_region_split(page_table, limit);
+
+	while((region = mmap_region_next(page_table, base)) && region->base < limit) {
+		mmap_region_delete(page_table, region);
+
+		if(region->file) {
+			file_put(region->file);
+		}
+
+		free(region);
+	}
 }
 
+struct mmap_dead_page {
+	struct page *page;
+	uint64_t entry;
+};
 
 // TODO: decrease reference count on the mmaped file
 int munmap(struct page_table *page_table, void *addr, size_t length) {
@@ -269,76 +457,283 @@ int munmap(struct page_table *page_table, void *addr, size_t length) {
 		return -1;
 	}
 
-	struct mmap_region *region = mmap_search_region(page_table, base);
+	uintptr_t limit = base + length;
 
-	if(region == NULL) {
-		return 0;
+	// huge pages straddling either end keep their outer part
+	if(base & (VMM_HUGE_PAGE_SIZE - 1)) {
+		vmm_split_huge_page(page_table, base);
 	}
 
-	if(length > region->limit) {
-		munmap(page_table, (void*)(base + region->limit), length - region->limit);
-		length = region->limit;
+	if(limit & (VMM_HUGE_PAGE_SIZE - 1)) {
+		vmm_split_huge_page(page_table, limit);
 	}
 
-	struct mmap_region *lower_split = NULL;
-	struct mmap_region *upper_split = NULL;
+	mmap_region_cut(page_table, base, limit);
+
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table, TLB_REASON_MUNMAP);
+
+	uint64_t old[VMM_MAP_BATCH];
+	VECTOR(struct mmap_dead_page) dead = { 0 };
 
-	if(region->base > base) {
-		lower_split = alloc(sizeof(struct mmap_region));
+	// a 2MiB block at a time the ptes are cleared and the page records taken out. the records
+	// are settled with what their pte held once no tlb can reach the frames anymore
+	for(uintptr_t block = base; block < limit;) {
+		uintptr_t vaddr = block;
 
-		*lower_split = (struct mmap_region) {
-			.base = region->base,
-			.limit = region->base - base,
-			.prot = region->prot,
-			.flags = region->flags,
-			.fd = region->fd,
-			.offset = region->offset
-		};
+		struct page *page = vmm_page_next(page_table, &vaddr);
+		if(page == NULL || vaddr >= limit) {
+			break;
+		}
+
+		if(vaddr > block) { // skip straight to the block of the next page
+			block = vaddr & ~(VMM_HUGE_PAGE_SIZE - 1);
+			if(block < base) {
+				block = base;
+			}
+		}
+
+		uintptr_t next = (block & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE;
+		if(next > limit) {
+			next = limit;
+		}
+
+		vmm_unmap_pages(page_table, block, (next - block) / PAGE_SIZE, old, &batch);
+
+		for(; (page = vmm_page_next(page_table, &vaddr)) && vaddr < next; vaddr += PAGE_SIZE) {
+			vmm_page_delete(page_table, vaddr);
+
+			VECTOR_PUSH(dead, ((struct mmap_dead_page) {
+				.page = page,
+				.entry = old[(vaddr - block) / PAGE_SIZE]
+			}));
+		}
+
+		block = next;
 	}
 
-	if(region->limit > length) {
-		upper_split = alloc(sizeof(struct mmap_region));
+	tlb_batch_flush(&batch);
 
-		*upper_split = (struct mmap_region) {
-			.base = region->base + length,
-			.limit = length - region->limit,
-			.prot = region->prot,
-			.flags = region->flags,
-			.fd = region->fd,
-			.offset = region->offset
-		};
+	for(size_t i = 0; i < dead.length; i++) { // stores through a shared mapping reach the file here
+		vmm_page_release(dead.data[i].page, dead.data[i].entry);
 	}
 
-	BST_GENERIC_DELETE(page_table->mmap_region_root, base, region);
-	BST_GENERIC_INSERT(page_table->mmap_region_root, base, lower_split);
-	BST_GENERIC_INSERT(page_table->mmap_region_root, base, upper_split);
+	VECTOR_CLEAR(dead);
 
-	for(size_t i = 0; i < region->limit / PAGE_SIZE; i++) {
-		struct page *page = hash_table_search(CURRENT_TASK->page_table->pages, &base, sizeof(base));
+	return 0;
+}
 
-		if(page) {
-			if(page->flags & VMM_SHARE_FLAG) {
-				(*page->reference)--;
+// every page in the range has to belong to some region. prot none keeps pages readable, the same
+// as mmap does
 
-				if(*page->reference == 0 && page->file) {
-					if(page->file->ops->shared == NULL) {
-						page->file->ops->write(page->file, (void*)(page->frame->addr + HIGH_VMA), PAGE_SIZE, page->offset);
-					}
+int mprotect(struct page_table *page_table, void *addr, size_t length, int prot) {
+	uintptr_t base = (uintptr_t)addr;
 
-					hash_table_delete(&page->file->vfs_node->shared_pages, &page->vaddr, sizeof(page->vaddr));
-				}
-			}
+	length = ALIGN_UP(length, PAGE_SIZE);
+
+	if(base == 0 || base % PAGE_SIZE != 0) {
+		set_errno(EINVAL);
+		return -1;
+	}
 
-			hash_table_delete(CURRENT_TASK->page_table->pages, &base, sizeof(base));
+	uintptr_t limit = base + length;
+
+	for(uintptr_t vaddr = base; vaddr < limit;) {
+		struct mmap_region *region = mmap_region_search(page_table, vaddr);
+		if(region == NULL) {
+			set_errno(ENOMEM);
+			return -1;
 		}
 
-		page_table->unmap_page(page_table, base);
-		base += PAGE_SIZE;
+		vaddr = region->base + region->limit;
+	}
+
+	if(base & (VMM_HUGE_PAGE_SIZE - 1)) {
+		vmm_split_huge_page(page_table, base);
+	}
+
+	if(limit & (VMM_HUGE_PAGE_SIZE - 1)) {
+		vmm_split_huge_page(page_table, limit);
+	}
+
+	mmap_region_split(page_table, base);
+	mmap_region_split(page_table, limit);
+
+	struct mmap_region *region;
+
+	for(uintptr_t vaddr = base; (region = mmap_region_next(page_table, vaddr)) && region->base < limit; vaddr = region->base + region->limit) {
+		region->prot = prot;
+	}
+
+	uint64_t set = 0;
+	uint64_t clear = 0;
+
+	if(prot & MMAP_PROT_WRITE) set |= VMM_FLAGS_RW; else clear |= VMM_FLAGS_RW;
+	if(prot & MMAP_PROT_EXEC) clear |= VMM_FLAGS_NX; else set |= VMM_FLAGS_NX;
+
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table, TLB_REASON_MPROTECT);
+
+	vmm_protect_pages(page_table, base, length / PAGE_SIZE, set, clear, &batch);
+
+	struct page *page;
+
+	for(uintptr_t vaddr = base; (page = vmm_page_next(page_table, &vaddr)) && vaddr < limit; vaddr += PAGE_SIZE) {
+		page->flags = (page->flags & ~clear) | set;
+
+		if(page->flags & VMM_COW_FLAG) {
+			page->flags &= ~(VMM_FLAGS_RW);
+		}
 	}
 
+	tlb_batch_flush(&batch);
+
 	return 0;
 }
 
+struct mmap_remap_stats {
+	size_t grown;
+	size_t shrunk;
+	size_t moved;
+	size_t pages_moved;
+	size_t tables_moved;
+};
+
+static struct mmap_remap_stats mmap_remap_stats;
+
+// a mapping grows in place when nothing follows it, otherwise it moves with its page table
+// entries and page records and no data is copied. a destination picked here keeps the source's
+// offset into 2MiB so that whole tables and huge pages can go along
+
+void *mremap(struct page_table *page_table, void *old_address, size_t old_size, size_t new_size, int flags, void *new_address) {
+	uintptr_t base = (uintptr_t)old_address;
+
+	old_size = ALIGN_UP(old_size, PAGE_SIZE);
+	new_size = ALIGN_UP(new_size, PAGE_SIZE);
+
+	if(base == 0 || base % PAGE_SIZE != 0 || old_size == 0 || new_size == 0 ||
+		(flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED)) || ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE))) {
+		set_errno(EINVAL);
+		return (void*)-1;
+	}
+
+	struct mmap_region *region = mmap_region_search(page_table, base);
+	if(region == NULL || base + old_size > region->base + region->limit) {
+		set_errno(EFAULT);
+		return (void*)-1;
+	}
+
+	uintptr_t new_base;
+
+	if(flags & MREMAP_FIXED) {
+		new_base = (uintptr_t)new_address;
+
+		if(new_base % PAGE_SIZE != 0 || new_base < page_table->mmap_min_addr || new_base >= MMAP_MAP_MAX_ADDR ||
+			new_size > MMAP_MAP_MAX_ADDR - new_base || (new_base < base + old_size && base < new_base + new_size)) {
+			set_errno(EINVAL);
+			return (void*)-1;
+		}
+
+		munmap(page_table, (void*)new_base, new_size);
+	} else if(new_size <= old_size) {
+		if(new_size < old_size) {
+			munmap(page_table, (void*)(base + new_size), old_size - new_size);
+			__atomic_add_fetch(&mmap_remap_stats.shrunk, 1, __ATOMIC_RELAXED);
+		}
+
+		return (void*)base;
+	} else {
+		uintptr_t end = base + old_size;
+		struct mmap_region *next = mmap_region_next(page_table, end);
+
+		// the same ceiling mmap_find_space keeps, checked without overflowing
+		if(end == region->base + region->limit && new_size <= MMAP_MAP_MAX_ADDR - base &&
+			(next == NULL || next->base >= base + new_size)) {
+			mmap_region_delete(page_table, region);
+
+			if(region->file && region->file_size == region->limit) { // a whole file mapping goes on into the file
+				region->file_size += new_size - old_size;
+			}
+
+			region->limit += new_size - old_size;
+
+			mmap_region_insert(page_table, region);
+
+			__atomic_add_fetch(&mmap_remap_stats.grown, 1, __ATOMIC_RELAXED);
+
+			return (void*)base;
+		}
+
+		if(!(flags & MREMAP_MAYMOVE)) {
+			set_errno(ENOMEM);
+			return (void*)-1;
+		}
+
+		if(old_size >= VMM_HUGE_PAGE_SIZE) {
+			new_base = mmap_find_space(page_table, new_size + VMM_HUGE_PAGE_SIZE);
+			if(new_base) {
+				new_base += (base - new_base) & (VMM_HUGE_PAGE_SIZE - 1);
+			}
+		} else {
+			new_base = mmap_find_space(page_table, new_size);
+		}
+
+		if(new_base == 0) {
+			set_errno(ENOMEM);
+			return (void*)-1;
+		}
+	}
+
+	if(new_size < old_size) {
+		munmap(page_table, (void*)(base + new_size), old_size - new_size);
+		old_size = new_size;
+	}
+
+	region = mmap_region_search(page_table, base); // the munmaps above may have split it
+
+	struct mmap_region *moved = alloc(sizeof(struct mmap_region));
+	size_t skip = base - region->base;
+
+	*moved = *region;
+	moved->base = new_base;
+	moved->limit = new_size;
+	moved->offset = region->offset + skip;
+
+	if(region->file && region->file_size == region->limit) {
+		moved->file_size = new_size;
+	} else {
+		moved->file_size = region->file_size > skip ? region->file_size - skip : 0;
+		if(moved->file_size > new_size) {
+			moved->file_size = new_size;
+		}
+	}
+
+	if(moved->file) {
+		file_get(moved->file);
+	}
+
+	size_t tables = 0;
+	size_t pages = vmm_move_range(page_table, base, new_base, old_size, &tables);
+
+	mmap_region_cut(page_table, base, base + old_size);
+	mmap_region_insert(page_table, moved);
+
+	struct mmap_remap_stats *stats = &mmap_remap_stats;
+
+	__atomic_add_fetch(&stats->moved, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->pages_moved, pages, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->tables_moved, tables, __ATOMIC_RELAXED);
+
+	return (void*)new_base;
+}
+
+void mmap_print_remap_stats() {
+	struct mmap_remap_stats *stats = &mmap_remap_stats;
+
+	print("mmap: mremap grown in place %d shrunk %d moved %d pages moved %d tables moved %d\n",
+		stats->grown, stats->shrunk, stats->moved, stats->pages_moved, stats->tables_moved);
+}
+
 extern void syscall_mmap(struct registers *regs) {
 	struct task *current_task = CURRENT_TASK;
 	if(current_task == NULL) {
@@ -376,3 +771,77 @@ extern void syscall_munmap(struct registers *regs) {
 
 	regs->rax = munmap(page_table, addr, length);
 }
+
+extern void syscall_mremap(struct registers *regs) {
+	struct task *current_task = CURRENT_TASK;
+	if(current_task == NULL) {
+		panic("cant find current task");
+	}
+
+	struct page_table *page_table = current_task->page_table;
+	void *old_address = (void*)regs->rdi;
+	size_t old_size = regs->rsi;
+	size_t new_size = regs->rdx;
+	int flags = regs->r10;
+	void *new_address = (void*)regs->r8;
+
+#if defined(SYSCALL_DEBUG_MEM) || defined(SYSCALL_DEBUG_ALL)
+	print("syscall: [pid %x, tid %x] mremap: old address {%x}, old size {%x}, new size {%x}, flags {%x}, new address {%x}\n", CORE_LOCAL->pid, CORE_LOCAL->tid, (uintptr_t)old_address, old_size, new_size, flags, (uintptr_t)new_address);
+#endif
+
+	regs->rax = (uint64_t)mremap(page_table, old_address, old_size, new_size, flags, new_address);
+}
+
+extern void syscall_mprotect(struct registers *regs) {
+	struct task *current_task = CURRENT_TASK;
+	if(current_task == NULL) {
+		panic("cant find current task");
+	}
+
+	struct page_table *page_table = current_task->page_table;
+	void *addr = (void*)regs->rdi;
+	size_t length = regs->rsi;
+	int prot = regs->rdx;
+
+#if defined(SYSCALL_DEBUG_MEM) || defined(SYSCALL_DEBUG_ALL)
+	print("syscall: [pid %x, tid %x] mprotect: addr {%x}, length {%x}, prot {%x}\n", CORE_LOCAL->pid, CORE_LOCAL->tid, (uintptr_t)addr, length, prot);
+#endif
+
+	regs->rax = mprotect(page_table, addr, length, prot | MMAP_PROT_USER);
+}
+
+// dumps the memory statistics to the kernel log, for checking that fork and exit give back what
+// they took. root only, it is a debugging aid and every call floods the log
+
+extern void syscall_memstat(struct registers *regs) {
+#if defined(SYSCALL_DEBUG_MEM) || defined(SYSCALL_DEBUG_ALL)
+	print("syscall: [pid %x, tid %x] memstat\n", CORE_LOCAL->pid, CORE_LOCAL->tid);
+#endif
+
+	if(CURRENT_TASK->effective_uid != 0) {
+		set_errno(EPERM);
+		regs->rax = -1;
+		return;
+	}
+
+	pmm_print_stats();
+	slab_print_stats();
+	slab_print_class_usage();
+	vmalloc_print_stats();
+
+	tlb_print_stats();
+	vmm_print_tlb_stats();
+	vmm_print_fork_stats();
+	vmm_print_teardown_stats();
+	sched_print_stack_stats();
+
+	vmm_print_fault_stats();
+	vmm_print_thp_stats();
+	mmap_print_remap_stats();
+
+	pcache_print_stats();
+	vmm_print_reclaim_stats();
+	swap_print_stats();
+
+	regs->rax = 0;
+}
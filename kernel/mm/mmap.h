@@ -7,7 +7,9 @@
 #define MMAP_MAP_SHARED 0x2
 #define MMAP_MAP_FIXED 0x4
 #define MMAP_MAP_ANONYMOUS 0x8
+#define MMAP_MAP_POPULATE 0x10
 #define MMAP_MAP_MIN_ADDR 0x80000000ull
+#define MMAP_MAP_MAX_ADDR 0x800000000000ull // end of the lower half with 4 level paging
 
 #define MMAP_PROT_NONE 0x0
 #define MMAP_PROT_READ 0x1
@@ -15,5 +17,15 @@
 #define MMAP_PROT_EXEC 0x4
 #define MMAP_PROT_USER 0x8
 
+#define MREMAP_MAYMOVE 0x1
+#define MREMAP_FIXED 0x2
+
 void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int munmap(struct page_table *page_table, void *addr, size_t length);
+int mprotect(struct page_table *page_table, void *addr, size_t length, int prot);
+void *mremap(struct page_table *page_table, void *old_address, size_t old_size, size_t new_size, int flags, void *new_address);
+void mmap_print_remap_stats();
+
+void mmap_region_insert(struct page_table *page_table, struct mmap_region *region);
+void mmap_region_delete(struct page_table *page_table, struct mmap_region *region);
+struct mmap_region *mmap_region_search(struct page_table *page_table, uintptr_t addr);
@@ -0,0 +1,341 @@
+#include <mm/pcache.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <fs/fd.h>
+#include <fs/vfs.h>
+#include <string.h>
+#include <debug.h>
+#include <cpu.h>
+#include <lock.h>
+
+// regular file data is held once per vfs node, in a radix tree keyed by page index. read() and
+// write() copy through it and file mappings map its frames directly, private ones read only
+// until the first write. every cached page sits on one lru list, the ones no mapping holds on
+// to are handed back to the pmm when free memory runs low
+
+struct pcache_stats {
+	size_t hits;
+	size_t misses;
+	size_t read_errors;
+	size_t evictions;
+	size_t truncated;
+	size_t writebacks;
+};
+
+static struct spinlock pcache_lock; // lru list and resident count
+static struct pcache_page *pcache_lru_head; // most recently used
+static struct pcache_page *pcache_lru_tail;
+static size_t pcache_resident;
+
+static struct pcache_stats pcache_stats;
+
+bool pcache_enabled(struct file_handle *file) {
+	return file->vfs_node && S_ISREG(file->stat->st_mode) && file->ops->read && file->ops->shared == NULL;
+}
+
+static void pcache_lru_unlink(struct pcache_page *page) {
+	if(page->lru_prev) {
+		page->lru_prev->lru_next = page->lru_next;
+	} else {
+		pcache_lru_head = page->lru_next;
+	}
+
+	if(page->lru_next) {
+		page->lru_next->lru_prev = page->lru_prev;
+	} else {
+		pcache_lru_tail = page->lru_prev;
+	}
+
+	page->lru_prev = NULL;
+	page->lru_next = NULL;
+}
+
+static void pcache_lru_push(struct pcache_page *page) {
+	page->lru_prev = NULL;
+	page->lru_next = pcache_lru_head;
+
+	if(pcache_lru_head) {
+		pcache_lru_head->lru_prev = page;
+	} else {
+		pcache_lru_tail = page;
+	}
+
+	pcache_lru_head = page;
+}
+
+static void pcache_free(struct pcache_page *page) {
+	pmm_free(page->frame.addr, 1);
+	slab_cache_free(pcache_page_cache, page);
+}
+
+// the node lock is held, a miss reads the page in from the filesystem
+
+static struct pcache_page *pcache_lookup(struct file_handle *file, off_t offset) {
+	struct vfs_node *node = file->vfs_node;
+	uint64_t index = offset / PAGE_SIZE;
+
+	struct pcache_page *page = radix_tree_search(&node->cached_pages, index);
+
+	if(page) {
+		__atomic_add_fetch(&pcache_stats.hits, 1, __ATOMIC_RELAXED);
+
+		spinlock_irqsave(&pcache_lock);
+		if(page != pcache_lru_head) {
+			pcache_lru_unlink(page);
+			pcache_lru_push(page);
+		}
+		spinrelease_irqsave(&pcache_lock);
+
+		return page;
+	}
+
+	__atomic_add_fetch(&pcache_stats.misses, 1, __ATOMIC_RELAXED);
+
+	if(pmm_free_page_cnt() < PMM_LOW_WATERMARK) {
+		pcache_reclaim(PCACHE_RECLAIM_BATCH);
+	}
+
+	uint64_t frame = pmm_alloc(1, 1);
+	if(frame == -1 && pcache_reclaim(PCACHE_RECLAIM_BATCH)) {
+		frame = pmm_alloc(1, 1);
+	}
+
+	if(frame == -1) {
+		return NULL;
+	}
+
+	off_t base = index * PAGE_SIZE;
+	off_t size = file->stat->st_size;
+
+	if(base < size) { // the tail past the end of the file stays zero
+		size_t cnt = size - base > PAGE_SIZE ? PAGE_SIZE : size - base;
+
+		if(file->ops->read(file, (void*)(frame + HIGH_VMA), cnt, base) == -1) {
+			__atomic_add_fetch(&pcache_stats.read_errors, 1, __ATOMIC_RELAXED);
+			pmm_free(frame, 1);
+			return NULL;
+		}
+	}
+
+	page = slab_cache_alloc(pcache_page_cache);
+
+	page->frame.addr = frame;
+	page->node = node;
+	page->offset = base;
+	page->refcnt = 1;
+
+	radix_tree_insert(&node->cached_pages, index, page);
+
+	spinlock_irqsave(&pcache_lock);
+	pcache_lru_push(page);
+	pcache_resident++;
+	spinrelease_irqsave(&pcache_lock);
+
+	return page;
+}
+
+// the caller gets a reference for its page record, dropped again with pcache_put
+
+struct pcache_page *pcache_get(struct file_handle *file, off_t offset) {
+	node_lock(file->vfs_node);
+
+	struct pcache_page *page = pcache_lookup(file, offset);
+	if(page) {
+		__atomic_add_fetch(&page->refcnt, 1, __ATOMIC_RELAXED);
+	}
+
+	node_unlock(file->vfs_node);
+
+	return page;
+}
+
+void pcache_dup(struct pcache_page *page) {
+	__atomic_add_fetch(&page->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void pcache_put(struct pcache_page *page) {
+	if(__atomic_sub_fetch(&page->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		pcache_free(page);
+	}
+}
+
+static void pcache_writeback(struct file_handle *file, struct pcache_page *page) {
+	if(file->ops->write == NULL) {
+		return;
+	}
+
+	node_lock(file->vfs_node);
+
+	off_t size = file->stat->st_size;
+
+	if(page->offset < size) {
+		size_t cnt = size - page->offset > PAGE_SIZE ? PAGE_SIZE : size - page->offset;
+
+		file->ops->write(file, (void*)(page->frame.addr + HIGH_VMA), cnt, page->offset);
+		__atomic_add_fetch(&pcache_stats.writebacks, 1, __ATOMIC_RELAXED);
+	}
+
+	node_unlock(file->vfs_node);
+}
+
+// drops a page record's hold on a cached frame, data stored through a shared mapping goes back
+// to the file first. entry is the pte the record was mapped with
+
+void pcache_unmap(struct page *page, uint64_t entry) {
+	struct pcache_page *cached = page->cached;
+
+	if((page->flags & VMM_SHARE_FLAG) && (entry & VMM_FLAGS_D) && page->file) {
+		pcache_writeback(page->file, cached);
+	}
+
+	page->cached = NULL;
+	pcache_put(cached);
+}
+
+// called with the node lock held, in place of ops->read
+
+ssize_t pcache_read(struct file_handle *file, void *buf, size_t cnt, off_t offset) {
+	off_t size = file->stat->st_size;
+
+	if(offset >= size) {
+		return 0;
+	}
+
+	if(offset + cnt > size) {
+		cnt = size - offset;
+	}
+
+	size_t done = 0;
+
+	while(done < cnt) {
+		off_t pos = offset + done;
+
+		struct pcache_page *page = pcache_lookup(file, pos);
+		if(page == NULL) {
+			return done ? done : -1;
+		}
+
+		size_t page_offset = pos & (PAGE_SIZE - 1);
+		size_t chunk = cnt - done > PAGE_SIZE - page_offset ? PAGE_SIZE - page_offset : cnt - done;
+
+		memcpy8(buf + done, (void*)(page->frame.addr + HIGH_VMA + page_offset), chunk);
+
+		done += chunk;
+	}
+
+	return done;
+}
+
+// called with the node lock held once ops->write has put the data in the file, writes go
+// through to the filesystem and only update the pages that are already resident
+
+void pcache_write(struct file_handle *file, const void *buf, size_t cnt, off_t offset) {
+	struct vfs_node *node = file->vfs_node;
+
+	if(node->cached_pages.element_cnt == 0) {
+		return;
+	}
+
+	size_t done = 0;
+
+	while(done < cnt) {
+		off_t pos = offset + done;
+		size_t page_offset = pos & (PAGE_SIZE - 1);
+		size_t chunk = cnt - done > PAGE_SIZE - page_offset ? PAGE_SIZE - page_offset : cnt - done;
+
+		struct pcache_page *page = radix_tree_search(&node->cached_pages, pos / PAGE_SIZE);
+		if(page) {
+			memcpy8((void*)(page->frame.addr + HIGH_VMA + page_offset), buf + done, chunk);
+		}
+
+		done += chunk;
+	}
+}
+
+// pages past the new size leave the tree, mapped ones live on until their last mapping goes
+
+void pcache_truncate(struct vfs_node *node, off_t size) {
+	node_lock(node);
+
+	size_t tail = size & (PAGE_SIZE - 1);
+
+	if(tail) {
+		struct pcache_page *page = radix_tree_search(&node->cached_pages, size / PAGE_SIZE);
+		if(page) {
+			memset8((void*)(page->frame.addr + HIGH_VMA + tail), 0, PAGE_SIZE - tail);
+		}
+	}
+
+	uint64_t index = DIV_ROUNDUP(size, PAGE_SIZE);
+	struct pcache_page *page;
+
+	while((page = radix_tree_next(&node->cached_pages, &index))) {
+		radix_tree_delete(&node->cached_pages, index);
+
+		spinlock_irqsave(&pcache_lock);
+		pcache_lru_unlink(page);
+		pcache_resident--;
+		spinrelease_irqsave(&pcache_lock);
+
+		__atomic_add_fetch(&pcache_stats.truncated, 1, __ATOMIC_RELAXED);
+
+		pcache_put(page);
+		index++;
+	}
+
+	node_unlock(node);
+}
+
+// walks the lru from the cold end. only pages nothing maps can go, and a node whose lock is
+// taken is skipped since its holder may well be the one asking for memory
+
+size_t pcache_reclaim(size_t page_cnt) {
+	struct pcache_page *victims = NULL;
+	size_t reclaimed = 0;
+
+	spinlock_irqsave(&pcache_lock);
+
+	struct pcache_page *page = pcache_lru_tail;
+
+	while(page && reclaimed < page_cnt) {
+		struct pcache_page *prev = page->lru_prev;
+		struct vfs_node *node = page->node;
+
+		if(__atomic_load_n(&page->refcnt, __ATOMIC_ACQUIRE) == 1 && spintrylock_irqsave(&node->lock)) {
+			if(__atomic_load_n(&page->refcnt, __ATOMIC_ACQUIRE) == 1) {
+				radix_tree_delete(&node->cached_pages, page->offset / PAGE_SIZE);
+				pcache_lru_unlink(page);
+				pcache_resident--;
+
+				page->lru_next = victims;
+				victims = page;
+				reclaimed++;
+			}
+
+			spinrelease_irqsave(&node->lock);
+		}
+
+		page = prev;
+	}
+
+	spinrelease_irqsave(&pcache_lock);
+
+	while(victims) {
+		struct pcache_page *next = victims->lru_next;
+		pcache_free(victims);
+		victims = next;
+	}
+
+	__atomic_add_fetch(&pcache_stats.evictions, reclaimed, __ATOMIC_RELAXED);
+
+	return reclaimed;
+}
+
+void pcache_print_stats() {
+	struct pcache_stats *stats = &pcache_stats;
+
+	print("pcache: resident pages %d hits %d misses %d read errors %d\n",
+		pcache_resident, stats->hits, stats->misses, stats->read_errors);
+	print("pcache: evicted %d truncated %d written back %d\n",
+		stats->evictions, stats->truncated, stats->writebacks);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <types.h>
+#include <mm/vmm.h>
+
+#define PCACHE_RECLAIM_BATCH 64
+
+struct vfs_node;
+struct file_handle;
+
+struct pcache_page {
+	struct frame frame; // page records of mappings point straight at this
+	struct vfs_node *node;
+	off_t offset;
+
+	int refcnt; // one for the node's tree, one per page record mapping the frame
+
+	struct pcache_page *lru_prev;
+	struct pcache_page *lru_next;
+};
+
+bool pcache_enabled(struct file_handle *file);
+struct pcache_page *pcache_get(struct file_handle *file, off_t offset);
+void pcache_dup(struct pcache_page *page);
+void pcache_put(struct pcache_page *page);
+void pcache_unmap(struct page *page, uint64_t entry);
+ssize_t pcache_read(struct file_handle *file, void *buf, size_t cnt, off_t offset);
+void pcache_write(struct file_handle *file, const void *buf, size_t cnt, off_t offset);
+void pcache_truncate(struct vfs_node *node, off_t size);
+size_t pcache_reclaim(size_t page_cnt);
+void pcache_print_stats();
@@ -5,93 +5,210 @@
 #include <string.h>
 #include <limine.h>
 #include <lock.h>
+#include <sched/smp.h>
+#include <acpi/srat.h>
+
+#define PMM_BLOCK_FREE (1 << 7)
+#define PMM_BLOCK_ORDER(meta) ((meta) & ~(PMM_BLOCK_FREE))
+
+struct pmm_block {
+	struct pmm_block *next;
+	struct pmm_block *last;
+};
 
 struct pmm_module {
-	struct limine_memmap_entry *mmap_entry;
+	int node;
+
+	size_t base_pfn;
+	size_t page_cnt;
+	size_t free_pages;
 
-	size_t bitmap_size;
-	size_t bitmap_entry_cnt;
-	size_t last_free;
-	uint8_t *bitmap;
+	uint8_t *block_meta; // per page: order of the free block headed by that page | PMM_BLOCK_FREE
+	struct pmm_block *free_list[PMM_MAX_ORDER + 1];
 
 	struct pmm_module *next;
 
 	struct spinlock lock;
 };
 
+struct pmm_node_stats {
+	size_t alloc_pages; // out of the node's buddy lists, frames parked in per cpu caches included
+	size_t hits;
+	size_t misses;
+};
+
 static struct pmm_module *root_module;
 static void *meta_buffer;
 
+static struct pmm_node_stats node_stats[NUMA_MAX_NODES];
+
 volatile struct limine_memmap_request limine_memmap_request = {
 	.id = LIMINE_MEMMAP_REQUEST,
 	.revision = 0
 };
 
-static void pmm_init_module(struct pmm_module *module, struct limine_memmap_entry *mmap_entry) {
-	size_t page_cnt = DIV_ROUNDUP(mmap_entry->length, PAGE_SIZE);
+static inline struct pmm_block *pmm_pfn_to_block(size_t pfn) {
+	return (struct pmm_block*)(pfn * PAGE_SIZE + HIGH_VMA);
+}
+
+static inline size_t pmm_block_to_pfn(struct pmm_block *block) {
+	return ((uintptr_t)block - HIGH_VMA) / PAGE_SIZE;
+}
 
-	module->mmap_entry = mmap_entry;
-	module->bitmap_size = DIV_ROUNDUP(page_cnt, 8);
-	module->bitmap_entry_cnt = page_cnt;
-	module->bitmap = meta_buffer;
+static size_t pmm_order_roundup(size_t cnt) {
+	size_t order = 0;
 
-	memset8(module->bitmap, 0, module->bitmap_size);
+	while((1ull << order) < cnt) {
+		order++;
+	}
 
-	meta_buffer += module->bitmap_size;
+	return order;
 }
 
-static uint64_t pmm_module_alloc(struct pmm_module *module, uint64_t cnt, uint64_t align) {
-	spinlock_irqsave(&module->lock);
+static void pmm_list_push(struct pmm_module *module, size_t pfn, size_t order) {
+	struct pmm_block *block = pmm_pfn_to_block(pfn);
+
+	block->last = NULL;
+	block->next = module->free_list[order];
+
+	if(module->free_list[order]) {
+		module->free_list[order]->last = block;
+	}
+
+	module->free_list[order] = block;
+	module->block_meta[pfn - module->base_pfn] = order | PMM_BLOCK_FREE;
+}
+
+static void pmm_list_remove(struct pmm_module *module, size_t pfn, size_t order) {
+	struct pmm_block *block = pmm_pfn_to_block(pfn);
+
+	if(block->next) {
+		block->next->last = block->last;
+	}
+
+	if(block->last) {
+		block->last->next = block->next;
+	} else {
+		module->free_list[order] = block->next;
+	}
+
+	module->block_meta[pfn - module->base_pfn] = 0;
+}
+
+static void pmm_module_free_block(struct pmm_module *module, size_t pfn, size_t order) {
+	module->free_pages += 1ull << order;
 
-	size_t alloc_base = ALIGN_UP(module->mmap_entry->base + (module->last_free * PAGE_SIZE), align * PAGE_SIZE); // calcuate base address for the allocation
-	size_t bit_base = (alloc_base - module->mmap_entry->base) / PAGE_SIZE;
+	while(order < PMM_MAX_ORDER) {
+		size_t buddy = pfn ^ (1ull << order);
 
-	for(size_t i = bit_base; i < module->bitmap_entry_cnt; i += align) {
-		if(module->bitmap_entry_cnt < (i + cnt)) {
-			spinrelease_irqsave(&module->lock);
-			return -1;
+		if(buddy < module->base_pfn || (buddy + (1ull << order)) > (module->base_pfn + module->page_cnt)) {
+			break;
 		}
 
-		for(size_t j = i, count = 0; j < (i + cnt); j++) {
-			if(BIT_TEST(module->bitmap, j)) {
-				alloc_base += align * PAGE_SIZE;
-				break;
-			}
+		if(module->block_meta[buddy - module->base_pfn] != (order | PMM_BLOCK_FREE)) {
+			break;
+		}
 
-			if(++count == cnt) {
-				for(size_t z = 0; z < count; z++) {
-					BIT_SET(module->bitmap, i + z);
-				}
+		pmm_list_remove(module, buddy, order);
 
-				module->last_free = 0;
+		if(buddy < pfn) {
+			pfn = buddy;
+		}
 
-				for(size_t z = j; z < module->bitmap_entry_cnt; z++) {
-					if(!BIT_TEST(module->bitmap, z)) {
-						module->last_free = z;
-						break;
-					}
-				}
+		order++;
+	}
+
+	pmm_list_push(module, pfn, order);
+}
 
-				spinrelease_irqsave(&module->lock);
+static void pmm_module_free_range(struct pmm_module *module, size_t pfn, size_t cnt) {
+	size_t end = pfn + cnt;
 
-				return alloc_base;
-			}
+	while(pfn < end) { // decompose the range into maximal naturally aligned blocks
+		size_t order = 0;
+
+		while(order < PMM_MAX_ORDER && (pfn & ((1ull << (order + 1)) - 1)) == 0 && (pfn + (1ull << (order + 1))) <= end) {
+			order++;
 		}
+
+		pmm_module_free_block(module, pfn, order);
+
+		pfn += 1ull << order;
+	}
+}
+
+static void pmm_init_module(struct pmm_module *module, uint64_t base, uint64_t length, int node) {
+	module->node = node;
+	module->base_pfn = base / PAGE_SIZE;
+	module->page_cnt = length / PAGE_SIZE;
+	module->block_meta = meta_buffer;
+
+	memset8(module->block_meta, 0, module->page_cnt);
+
+	meta_buffer += module->page_cnt;
+
+	pmm_module_free_range(module, module->base_pfn, module->page_cnt);
+}
+
+static uint64_t pmm_buddy_alloc(struct pmm_module *module, uint64_t cnt, size_t order) {
+	size_t current_order = order;
+
+	while(current_order <= PMM_MAX_ORDER && module->free_list[current_order] == NULL) {
+		current_order++;
+	}
+
+	if(current_order > PMM_MAX_ORDER) {
+		return -1;
+	}
+
+	size_t pfn = pmm_block_to_pfn(module->free_list[current_order]);
+	pmm_list_remove(module, pfn, current_order);
+
+	while(current_order > order) { // split, handing the upper buddy back at each level
+		current_order--;
+		pmm_list_push(module, pfn + (1ull << current_order), current_order);
+	}
+
+	module->free_pages -= 1ull << order;
+
+	if((1ull << order) > cnt) { // trim the unused tail of the block
+		pmm_module_free_range(module, pfn + cnt, (1ull << order) - cnt);
 	}
 
+	return pfn * PAGE_SIZE;
+}
+
+static uint64_t pmm_module_alloc(struct pmm_module *module, uint64_t cnt, size_t order) {
+	spinlock_irqsave(&module->lock);
+	uint64_t alloc = pmm_buddy_alloc(module, cnt, order);
 	spinrelease_irqsave(&module->lock);
 
-	return -1;
+	return alloc;
 }
 
-static void pmm_module_free(struct pmm_module *module, uint64_t base, uint64_t cnt) {
+static size_t pmm_module_alloc_batch(struct pmm_module *module, uint64_t *frames, size_t cnt) {
 	spinlock_irqsave(&module->lock);
 
-	for(size_t i = DIV_ROUNDUP(base, PAGE_SIZE); i < (DIV_ROUNDUP(base, PAGE_SIZE) + cnt); i++) {
-		BIT_CLEAR(module->bitmap, i);
+	size_t i = 0;
+	for(; i < cnt; i++) {
+		uint64_t alloc = pmm_buddy_alloc(module, 1, 0);
+		if(alloc == -1) {
+			break;
+		}
+		frames[i] = alloc;
 	}
 
 	spinrelease_irqsave(&module->lock);
+
+	return i;
+}
+
+static void pmm_module_free(struct pmm_module *module, uint64_t base, uint64_t cnt) {
+	spinlock_irqsave(&module->lock);
+	pmm_module_free_range(module, base / PAGE_SIZE, cnt);
+	spinrelease_irqsave(&module->lock);
+
+	__atomic_fetch_sub(&node_stats[module->node].alloc_pages, cnt, __ATOMIC_RELAXED);
 }
 
 void pmm_init() {
@@ -100,10 +217,12 @@ void pmm_init() {
 
 	size_t buffer_size = 0;
 
+	numa_init();
+
 	for(size_t i = 0; i < entry_count; i++) { // calcuate the size the metabuffer needs to be
 		if(mmap[i]->type == LIMINE_MEMMAP_USABLE) {
 			size_t entry_cnt = DIV_ROUNDUP(mmap[i]->length, PAGE_SIZE);
-			buffer_size += sizeof(struct pmm_module) * 2 + DIV_ROUNDUP(entry_cnt, 8);
+			buffer_size += sizeof(struct pmm_module) * 2 * (numa_range_cnt * 2 + 1) + entry_cnt;
 		}
 
 		if(mmap[i]->base < 0x100000) {
@@ -130,64 +249,374 @@ void pmm_init() {
 		}
 	}
 
-	for(size_t i = 0; i < entry_count; i++) { // create bitmap modules for all usable regions
+	for(size_t i = 0; i < entry_count; i++) { // create buddy modules for all usable regions, split at numa boundaries
 		if(mmap[i]->type == LIMINE_MEMMAP_USABLE && mmap[i]->length) {
-			print("pmm: [%x -> %x] length %x type %x\n", mmap[i]->base, mmap[i]->base + mmap[i]->length, mmap[i]->length, mmap[i]->type);
+			uint64_t base = mmap[i]->base;
+			uint64_t limit = mmap[i]->base + mmap[i]->length;
+
+			while(base < limit) {
+				uint64_t node_limit;
+				int node = numa_address_node(base, &node_limit);
+
+				node_limit = node_limit / PAGE_SIZE * PAGE_SIZE;
+				if(node_limit > limit || node_limit <= base) {
+					node_limit = limit;
+				}
+
+				print("pmm: [%x -> %x] length %x node %d\n", base, node_limit, node_limit - base, node);
 
-			if(root_module == NULL) {
 				meta_buffer = (void*)(ALIGN_UP((uintptr_t)meta_buffer - HIGH_VMA, sizeof(struct pmm_module)) + HIGH_VMA);
-				root_module = (struct pmm_module*)meta_buffer;
-				memset8((void*)root_module, 0, sizeof(struct pmm_module));
+				struct pmm_module *module = (struct pmm_module*)meta_buffer;
+				memset8((void*)module, 0, sizeof(struct pmm_module));
 				meta_buffer += sizeof(struct pmm_module) * 2;
-				pmm_init_module(root_module, mmap[i]);
+
+				pmm_init_module(module, base, node_limit - base, node);
+
+				if(root_module == NULL) {
+					root_module = module;
+				} else {
+					struct pmm_module *tail = root_module;
+					while(tail->next) {
+						tail = tail->next;
+					}
+					tail->next = module;
+				}
+
+				base = node_limit;
+			}
+		}
+	}
+
+	print("pmm: initialised\n");
+}
+
+static struct pmm_module *pmm_find_module(uint64_t base, uint64_t cnt) {
+	size_t pfn = base / PAGE_SIZE;
+
+	for(struct pmm_module *module = root_module; module; module = module->next) {
+		if(pfn >= module->base_pfn && (pfn + cnt) <= (module->base_pfn + module->page_cnt)) {
+			return module;
+		}
+	}
+
+	return NULL;
+}
+
+// only a placement preference, a stale answer after migrating costs locality and nothing else
+static int pmm_local_node() {
+	struct cpu_local *cpu_local = CORE_LOCAL;
+	return cpu_local ? cpu_local->numa_node : 0;
+}
+
+static void pmm_account_node(int preferred, int node, size_t cnt) {
+	struct pmm_node_stats *stats = &node_stats[node];
+
+	__atomic_fetch_add(&stats->alloc_pages, cnt, __ATOMIC_RELAXED);
+
+	if(node == preferred) {
+		__atomic_fetch_add(&stats->hits, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&stats->misses, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static uint64_t pmm_alloc_pages(uint64_t cnt, size_t order) {
+	int preferred = pmm_local_node();
+	const int *fallback = numa_fallback_list(preferred);
+
+	for(size_t i = 0; i < numa_node_cnt; i++) { // walk the nodes in distance order from the calling cpu
+		for(struct pmm_module *module = root_module; module; module = module->next) {
+			if(module->node != fallback[i]) {
 				continue;
 			}
 
-			struct pmm_module *node = root_module;
-			while(node->next) {
-				node = node->next;
+			uint64_t alloc = pmm_module_alloc(module, cnt, order);
+			if(alloc != -1) {
+				pmm_account_node(preferred, module->node, cnt);
+				return alloc;
 			}
+		}
+	}
+
+	return -1;
+}
 
-			meta_buffer = (void*)(ALIGN_UP((uintptr_t)meta_buffer - HIGH_VMA, sizeof(struct pmm_module)) + HIGH_VMA);
-			node->next = (struct pmm_module*)meta_buffer;
-			memset8((void*)node->next, 0, sizeof(struct pmm_module));
-			meta_buffer += sizeof(struct pmm_module) * 2;
+static void pmm_pcp_refill(struct pmm_pcp *pcp) {
+	int preferred = pmm_local_node();
+	const int *fallback = numa_fallback_list(preferred);
 
-			pmm_init_module(node->next, mmap[i]);
+	for(size_t i = 0; i < numa_node_cnt && pcp->cnt < PMM_PCP_BATCH; i++) {
+		for(struct pmm_module *module = root_module; module && pcp->cnt < PMM_PCP_BATCH; module = module->next) {
+			if(module->node != fallback[i]) {
+				continue;
+			}
+
+			size_t cnt = pmm_module_alloc_batch(module, pcp->frames + pcp->cnt, PMM_PCP_BATCH - pcp->cnt);
+			if(cnt) {
+				pmm_account_node(preferred, module->node, cnt);
+			}
+
+			pcp->cnt += cnt;
 		}
 	}
 
-	print("pmm: initialised\n");
+	pcp->refills++;
 }
 
+static void pmm_pcp_drain(struct pmm_pcp *pcp, size_t cnt) {
+	struct pmm_module *locked = NULL;
 
-uint64_t pmm_alloc(uint64_t cnt, uint64_t align) {
-	struct pmm_module *module = root_module;
+	while(cnt-- && pcp->cnt) { // consecutive frames tend to share a module, only swap locks when they don't
+		uint64_t frame = pcp->frames[--pcp->cnt];
+		struct pmm_module *module = pmm_find_module(frame, 1);
 
-	do {
-		uint64_t alloc = pmm_module_alloc(module, cnt, align);
+		if(module != locked) {
+			if(locked) spinrelease_irqsave(&locked->lock);
+			if(module) spinlock_irqsave(&module->lock);
+			locked = module;
+		}
 
-		if(alloc == -1) {
-			module = module->next;
-			continue;
+		if(module) {
+			pmm_module_free_range(module, frame / PAGE_SIZE, 1);
+			__atomic_fetch_sub(&node_stats[module->node].alloc_pages, 1, __ATOMIC_RELAXED);
 		}
+	}
+
+	if(locked) {
+		spinrelease_irqsave(&locked->lock);
+	}
+
+	pcp->drains++;
+}
+
+// the per cpu lists are only safe with interrupts off, a task could otherwise move to another
+// cpu between looking its list up and using it
+
+static uint64_t pmm_pcp_alloc() {
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
 
+	struct pmm_pcp *pcp = &CORE_LOCAL->pcp;
+
+	if(pcp->cnt) {
+		pcp->hits++;
+	} else {
+		pcp->misses++;
+		pmm_pcp_refill(pcp);
+	}
+
+	uint64_t alloc = pcp->cnt ? pcp->frames[--pcp->cnt] : -1;
+
+	if(interrupts) {
+		asm volatile ("sti");
+	}
+
+	return alloc;
+}
+
+static void pmm_pcp_free(uint64_t base) {
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
+
+	struct pmm_pcp *pcp = &CORE_LOCAL->pcp;
+
+	if(pcp->cnt == PMM_PCP_HIGH) {
+		pmm_pcp_drain(pcp, PMM_PCP_BATCH);
+	}
+
+	pcp->frames[pcp->cnt++] = base;
+	pcp->frees++;
+
+	if(interrupts) {
+		asm volatile ("sti");
+	}
+}
+
+static uint64_t pmm_zero_pool_alloc() {
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
+
+	struct pmm_pcp *pcp = &CORE_LOCAL->pcp;
+
+	uint64_t alloc = -1;
+
+	if(pcp->zeroed_cnt) {
+		alloc = pcp->zeroed[--pcp->zeroed_cnt];
+		pcp->zeroed_hits++;
+	} else {
+		pcp->zeroed_misses++;
+	}
+
+	if(interrupts) {
+		asm volatile ("sti");
+	}
+
+	return alloc;
+}
+
+void pmm_zero_pool_refill() {
+	if(CORE_LOCAL == NULL) {
+		return;
+	}
+
+	for(;;) { // one page at a time so that an interrupt is never held off for more than a single clear
+		bool interrupts = get_interrupt_state();
+		asm volatile ("cli");
+
+		struct pmm_pcp *pcp = &CORE_LOCAL->pcp;
+
+		if(pcp->zeroed_cnt == PMM_ZERO_POOL_SIZE) {
+			if(interrupts) asm volatile ("sti");
+			return;
+		}
+
+		uint64_t frame = pmm_pcp_alloc();
+		if(frame == -1) {
+			frame = pmm_alloc_pages(1, 0);
+		}
+
+		if(frame != -1) {
+			memset64((void*)(frame + HIGH_VMA), 0, PAGE_SIZE / 8);
+			pcp->zeroed[pcp->zeroed_cnt++] = frame;
+		}
+
+		if(interrupts) asm volatile ("sti");
+
+		if(frame == -1) {
+			return;
+		}
+	}
+}
+
+static uint64_t pmm_alloc_frames(uint64_t cnt, uint64_t align, bool zero) {
+	if(cnt == 0) {
+		return -1;
+	}
+
+	// buddy blocks are naturally aligned to their size, so alignment is just a lower bound on the order
+	size_t order = pmm_order_roundup(cnt);
+	size_t align_order = pmm_order_roundup(align ? align : 1);
+
+	if(align_order > order) {
+		order = align_order;
+	}
+
+	if(order > PMM_MAX_ORDER) {
+		return -1;
+	}
+
+	uint64_t alloc = -1;
+
+	if(order == 0 && CORE_LOCAL) {
+		if(zero) {
+			alloc = pmm_zero_pool_alloc();
+			if(alloc != -1) {
+				return alloc;
+			}
+		}
+
+		alloc = pmm_pcp_alloc();
+	}
+
+	if(alloc == -1) {
+		alloc = pmm_alloc_pages(cnt, order);
+	}
+
+	if(alloc == -1) {
+		return -1;
+	}
+
+	if(zero) {
 		memset64((void*)(alloc + HIGH_VMA), 0, (cnt * PAGE_SIZE) / 8);
+	}
 
-		return alloc;
-	} while(module);
+	return alloc;
+}
 
-	return -1;
+uint64_t pmm_alloc(uint64_t cnt, uint64_t align) {
+	return pmm_alloc_frames(cnt, align, true);
+}
+
+uint64_t pmm_alloc_nozero(uint64_t cnt, uint64_t align) {
+	return pmm_alloc_frames(cnt, align, false);
+}
+
+// single pages for callers that map many at once, each module lock is taken once per batch
+// instead of once per page. returns how many of the cnt frames could be had
+
+size_t pmm_alloc_batch(uint64_t *frames, size_t cnt, bool zero) {
+	int preferred = pmm_local_node();
+	const int *fallback = numa_fallback_list(preferred);
+	size_t done = 0;
+
+	for(size_t i = 0; i < numa_node_cnt && done < cnt; i++) {
+		for(struct pmm_module *module = root_module; module && done < cnt; module = module->next) {
+			if(module->node != fallback[i]) {
+				continue;
+			}
+
+			size_t got = pmm_module_alloc_batch(module, frames + done, cnt - done);
+			if(got) {
+				pmm_account_node(preferred, module->node, got);
+			}
+
+			done += got;
+		}
+	}
+
+	if(zero) {
+		for(size_t i = 0; i < done; i++) {
+			memset64((void*)(frames[i] + HIGH_VMA), 0, PAGE_SIZE / 8);
+		}
+	}
+
+	return done;
 }
 
 void pmm_free(uint64_t base, uint64_t cnt) {
-	struct pmm_module *module = root_module;
+	struct pmm_module *module = pmm_find_module(base, cnt);
+	if(module == NULL) {
+		return;
+	}
 
-	do {
-		struct limine_memmap_entry *mmap = module->mmap_entry;
-		if(base >= mmap->base && (mmap->base + cnt * PAGE_SIZE) <= (mmap->base + module->bitmap_entry_cnt * PAGE_SIZE)) {
-			return pmm_module_free(module, base - mmap->base, cnt);
+	if(cnt == 1 && CORE_LOCAL) {
+		return pmm_pcp_free(base);
+	}
+
+	pmm_module_free(module, base, cnt);
+}
+
+size_t pmm_free_page_cnt() {
+	size_t free_pages = 0;
+
+	for(struct pmm_module *module = root_module; module; module = module->next) {
+		free_pages += __atomic_load_n(&module->free_pages, __ATOMIC_RELAXED);
+	}
+
+	return free_pages;
+}
+
+void pmm_print_stats() {
+	for(size_t i = 0; i < numa_node_cnt; i++) {
+		size_t free_pages = 0;
+
+		for(struct pmm_module *module = root_module; module; module = module->next) {
+			if(module->node == i) {
+				free_pages += module->free_pages;
+			}
 		}
-		module = module->next;
-	} while(module);
+
+		print("pmm: node %d: free pages %x allocated pages %x local %d remote %d\n", i,
+			free_pages, node_stats[i].alloc_pages, node_stats[i].hits, node_stats[i].misses);
+	}
+
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct cpu_local *cpu_local = cpu_local_list.data[i];
+		struct pmm_pcp *pcp = &cpu_local->pcp;
+
+		print("pmm: cpu %d: pcp cached %d hits %d misses %d frees %d refills %d drains %d\n", cpu_local->apic_id,
+			pcp->cnt, pcp->hits, pcp->misses, pcp->frees, pcp->refills, pcp->drains);
+		print("pmm: cpu %d: zero pool cached %d hits %d misses %d\n", cpu_local->apic_id,
+			pcp->zeroed_cnt, pcp->zeroed_hits, pcp->zeroed_misses);
+	}
 }
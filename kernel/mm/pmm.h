@@ -1,9 +1,41 @@
 #pragma once
 
 #include <limine.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PMM_MAX_ORDER 20
+
+#define PMM_PCP_HIGH 64
+#define PMM_PCP_BATCH 32
+#define PMM_ZERO_POOL_SIZE 32
+
+#define PMM_LOW_WATERMARK 0x400 // free pages below which caches start handing memory back
+
+struct pmm_pcp {
+	uint64_t frames[PMM_PCP_HIGH];
+	size_t cnt;
+
+	size_t hits;
+	size_t misses;
+	size_t frees;
+	size_t refills;
+	size_t drains;
+
+	uint64_t zeroed[PMM_ZERO_POOL_SIZE];
+	size_t zeroed_cnt;
+
+	size_t zeroed_hits;
+	size_t zeroed_misses;
+};
 
 void pmm_init();
 uint64_t pmm_alloc(uint64_t cnt, uint64_t align);
+uint64_t pmm_alloc_nozero(uint64_t cnt, uint64_t align);
+size_t pmm_alloc_batch(uint64_t *frames, size_t cnt, bool zero);
 void pmm_free(uint64_t base, uint64_t cnt);
+size_t pmm_free_page_cnt();
+void pmm_zero_pool_refill();
+void pmm_print_stats();
 
 extern volatile struct limine_memmap_request limine_memmap_request;
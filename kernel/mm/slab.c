@@ -1,18 +1,52 @@
 #include <mm/pmm.h>
 #include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <cpu.h>
 #include <string.h>
 #include <debug.h>
 #include <lock.h>
+#include <sched/smp.h>
+#include <sched/sched.h>
+#include <events/queue.h>
+#include <fs/vfs.h>
+#include <fs/fd.h>
+#include <radix.h>
+#include <mm/pcache.h>
 
-#define OBJECTS_PER_SLAB 512
+// every slab is a naturally aligned SLAB_SIZE block with its header at the base, so the
+// owner of any object is found by masking its address
+
+#define SLAB_SIZE 0x10000
+#define SLAB_MAX_OBJECT_SIZE (SLAB_SIZE / 8)
+#define SLAB_EMPTY_RESERVE 1
+
+#define SLAB_MAGIC 0x51ab51ab
+
+// size classes step through 2^k and 1.5 * 2^k: 32, 48, 64, 96, 128 ... 6144, 8192
+
+#define SLAB_MIN_CLASS_SHIFT 5
+#define SLAB_MIN_CLASS_SIZE (1ull << SLAB_MIN_CLASS_SHIFT)
+#define SLAB_CLASS_CNT 17
 
 struct slab;
 
 struct cache {
+	size_t size;
 	size_t object_size;
+	size_t objects_per_slab;
+	size_t buffer_offset;
+
 	size_t active_slabs;
-	size_t pages_per_slab;
+	size_t empty_slabs;
+
+	int magazine;
+
+	size_t lock_acquisitions;
+	size_t lock_contentions;
+
+	size_t allocations;
+	size_t requested_bytes;
+	size_t frees;
 
 	const char *name;
 
@@ -26,10 +60,13 @@ struct cache {
 };
 
 struct slab {
+	uint32_t magic;
+
 	size_t available_objects;
 	size_t total_objects;
-	
-	uint8_t *bitmap;
+	size_t bump;
+
+	void *free_list; // freed objects are chained through their first word
 	void *buffer;
 
 	struct cache *cache;
@@ -38,42 +75,74 @@ struct slab {
 };
 
 static struct cache *root_cache;
+static struct cache cache_cache;
+static struct cache *size_classes[SLAB_CLASS_CNT];
+static int magazine_cnt;
+
+struct cache *task_cache;
+struct cache *page_cache;
+struct cache *frame_cache;
+struct cache *vfs_node_cache;
+struct cache *file_handle_cache;
+struct cache *fd_handle_cache;
+struct cache *waitq_trigger_cache;
+struct cache *radix_node_cache;
+struct cache *pcache_page_cache;
+
+static size_t large_allocations;
+static size_t large_requested_bytes;
+static size_t large_allocated_bytes;
+
+static inline void *slab_block(void *obj) {
+	return (void*)((uintptr_t)obj & ~((uintptr_t)SLAB_SIZE - 1));
+}
 
 static struct slab *cache_alloc_slab(struct cache *cache) {
-	struct slab *new_slab = (struct slab*)(pmm_alloc(cache->pages_per_slab, 1) + HIGH_VMA);
+	uint64_t paddr = pmm_alloc_nozero(SLAB_SIZE / PAGE_SIZE, SLAB_SIZE / PAGE_SIZE);
+	if(paddr == -1) {
+		panic("slab: out of memory");
+	}
+
+	struct slab *new_slab = (struct slab*)(paddr + HIGH_VMA);
 
-	new_slab->bitmap = (uint8_t*)((uintptr_t)new_slab + sizeof(struct slab));
-	new_slab->buffer = (void*)(ALIGN_UP((uintptr_t)new_slab->bitmap + OBJECTS_PER_SLAB - HIGH_VMA, 16) + HIGH_VMA);
-	new_slab->available_objects = OBJECTS_PER_SLAB;
-	new_slab->total_objects = OBJECTS_PER_SLAB;
+	new_slab->magic = SLAB_MAGIC;
+	new_slab->free_list = NULL;
+	new_slab->bump = 0;
+	new_slab->buffer = (void*)((uintptr_t)new_slab + cache->buffer_offset);
+	new_slab->available_objects = cache->objects_per_slab;
+	new_slab->total_objects = cache->objects_per_slab;
 	new_slab->cache = cache;
 
 	if(cache->slab_empty)
 		cache->slab_empty->last = new_slab;
 
 	new_slab->next = cache->slab_empty;
+	new_slab->last = NULL;
 	cache->slab_empty = new_slab;
 
+	cache->active_slabs++;
+	cache->empty_slabs++;
+
 	return new_slab;
 }
 
+static void cache_unlink_slab(struct slab **head, struct slab *slab) {
+	if(slab->next != NULL)
+		slab->next->last = slab->last;
+	if(slab->last != NULL)
+		slab->last->next = slab->next;
+	if(*head == slab)
+		*head = slab->next;
+
+	slab->next = NULL;
+	slab->last = NULL;
+}
+
 static int cache_move_slab(struct slab **dest_head, struct slab **src_head, struct slab *src) {
 	if(!src || !*src_head)
 		return -1; 
 
-	if(src->next != NULL)
-		src->next->last = src->last;
-	if(src->last != NULL)
-		src->last->next = src->next;
-	if(*src_head == src)
-		*src_head = src->next;
-
-	if(!*dest_head) {
-		src->last = NULL;
-		src->next = NULL;
-		*dest_head = src; 
-		return 0;
-	}
+	cache_unlink_slab(src_head, src);
 
 	src->next = *dest_head;
 	src->last = NULL;
@@ -87,25 +156,64 @@ static int cache_move_slab(struct slab **dest_head, struct slab **src_head, stru
 	return 0;
 }
 
+static struct slab **cache_slab_list(struct cache *cache, struct slab *slab) {
+	if(slab->available_objects == slab->total_objects) {
+		return &cache->slab_empty;
+	} else if(slab->available_objects == 0) {
+		return &cache->slab_full;
+	}
+
+	return &cache->slab_partial;
+}
+
+static void cache_relist_slab(struct cache *cache, struct slab *slab, struct slab **src_head) {
+	struct slab **dest_head = cache_slab_list(cache, slab);
+
+	if(dest_head == src_head) {
+		return;
+	}
+
+	if(src_head == &cache->slab_empty) cache->empty_slabs--;
+	if(dest_head == &cache->slab_empty) cache->empty_slabs++;
+
+	cache_move_slab(dest_head, src_head, slab);
+}
+
 static void *slab_alloc(struct slab *slab) {
-	for(size_t i = 0; i < slab->total_objects; i++) {
-		if(!BIT_TEST(slab->bitmap, i)) {
-			BIT_SET(slab->bitmap, i);
-			slab->available_objects--;
-			memset8(slab->buffer + (i * slab->cache->object_size), 0, slab->cache->object_size);
-			return slab->buffer + (i * slab->cache->object_size);
-		}
+	struct cache *cache = slab->cache;
+	void *obj = slab->free_list;
+
+	if(obj) {
+		slab->free_list = *(void**)obj;
+	} else { // objects that have never been handed out are carved off lazily
+		obj = slab->buffer + slab->bump++ * cache->object_size;
 	}
 
-	panic("slab: returning a null pointer");
+	slab->available_objects--;
 
-	return NULL;
+	return obj;
 }
 
-static void *cache_alloc_obj(struct cache *cache) {
-	struct slab *slab = NULL;
+static void cache_lock(struct cache *cache) {
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
+
+	bool contended = __atomic_test_and_set(&cache->lock.lock, __ATOMIC_ACQUIRE);
+	if(contended) {
+		raw_spinlock(&cache->lock.lock);
+	}
+
+	cache->lock.interrupts = interrupts;
+	cache->lock_acquisitions++;
+	cache->lock_contentions += contended;
+}
+
+static void cache_unlock(struct cache *cache) {
+	spinrelease_irqsave(&cache->lock);
+}
 
-	spinlock_irqsave(&cache->lock);
+static void *cache_pop_obj(struct cache *cache) {
+	struct slab *slab = NULL;
 
 	if(cache->slab_partial) {
 		slab = cache->slab_partial;
@@ -115,154 +223,296 @@ static void *cache_alloc_obj(struct cache *cache) {
 
 	if(!slab) {
 		slab = cache_alloc_slab(cache);
-		cache->slab_empty = slab;
 	}
 
+	struct slab **src_head = cache_slab_list(cache, slab);
+
 	void *addr = slab_alloc(slab);
 
-	if(slab->available_objects == 0) {
-		cache_move_slab(&cache->slab_full, &cache->slab_partial, slab);
-	} else if(slab->available_objects == (slab->total_objects - 1)) {
-		cache_move_slab(&cache->slab_partial, &cache->slab_empty, slab);
+	cache_relist_slab(cache, slab, src_head);
+
+	return addr;
+}
+
+static void cache_push_obj(struct cache *cache, void *obj) {
+	struct slab *slab = slab_block(obj);
+	size_t offset = (uintptr_t)obj - (uintptr_t)slab->buffer;
+
+	if(offset % cache->object_size || offset / cache->object_size >= slab->bump) {
+		print("slab: bad free of %x in cache %s\n", (uintptr_t)obj, cache->name);
+		return;
 	}
 
-	spinrelease_irqsave(&cache->lock);
+	struct slab **src_head = cache_slab_list(cache, slab);
 
-	return addr;
+	*(void**)obj = slab->free_list;
+	slab->free_list = obj;
+	slab->available_objects++;
+
+	cache_relist_slab(cache, slab, src_head);
+
+	if(slab->available_objects == slab->total_objects && cache->empty_slabs > SLAB_EMPTY_RESERVE) { // hand surplus empty slabs back to the pmm
+		cache_unlink_slab(&cache->slab_empty, slab);
+		cache->empty_slabs--;
+		cache->active_slabs--;
+
+		slab->magic = 0;
+		pmm_free((uintptr_t)slab - HIGH_VMA, SLAB_SIZE / PAGE_SIZE);
+	}
 }
 
-static size_t slab_get_object_size(struct slab *slab, void *obj) {
-	if(!slab)
-		return 0;
+static struct slab_magazine *cache_magazine(struct cache *cache) {
+	struct cpu_local *cpu_local = CORE_LOCAL;
+
+	if(cpu_local == NULL || cache->magazine == -1) {
+		return NULL;
+	}
+
+	return &cpu_local->slab_magazines[cache->magazine];
+}
+
+// magazines are only ever touched by their own cpu with interrupts masked, so the fast
+// paths need neither the cache lock nor an atomic. the magazine is looked up after the cli,
+// before it the task may still move to another cpu
+
+static void *cache_alloc_obj(struct cache *cache, size_t size, bool zero) {
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
 
-	spinlock_irqsave(&slab->cache->lock);
+	struct slab_magazine *magazine = cache_magazine(cache);
+	void *addr = NULL;
 
-	struct slab *root = slab;
+	if(magazine) {
+		magazine->allocations++;
+		magazine->requested_bytes += size;
 
-	while(slab) {
-		if(slab->buffer <= obj && (slab->buffer + slab->cache->object_size * slab->total_objects) > obj) {
-			spinrelease_irqsave(&root->cache->lock);
-			return slab->cache->object_size;
+		if(magazine->cnt) {
+			magazine->hits++;
+		} else {
+			magazine->misses++;
+
+			cache_lock(cache);
+			while(magazine->cnt < SLAB_MAGAZINE_BATCH) {
+				magazine->objects[magazine->cnt++] = cache_pop_obj(cache);
+			}
+			cache_unlock(cache);
 		}
-		slab = slab->next;
+
+		addr = magazine->objects[--magazine->cnt];
 	}
 
-	spinrelease_irqsave(&root->cache->lock);
+	if(interrupts) {
+		asm volatile ("sti");
+	}
 
-	return 0;
+	if(magazine == NULL) {
+		cache_lock(cache);
+		cache->allocations++;
+		cache->requested_bytes += size;
+		addr = cache_pop_obj(cache);
+		cache_unlock(cache);
+	}
+
+	if(zero) {
+		memset64(addr, 0, cache->object_size / 8);
+	}
+
+	return addr;
 }
 
-static size_t cache_get_object_size(struct cache *cache, void *obj) {
-	size_t partial_object_size = slab_get_object_size(cache->slab_partial, obj);
-	if(partial_object_size) {
-		return partial_object_size;
+static void cache_free_obj(struct cache *cache, void *obj) {
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
+
+	struct slab_magazine *magazine = cache_magazine(cache);
+
+	if(magazine == NULL) {
+		if(interrupts) {
+			asm volatile ("sti");
+		}
+
+		cache_lock(cache);
+		cache->frees++;
+		cache_push_obj(cache, obj);
+		cache_unlock(cache);
+		return;
 	}
 
-	size_t full_object_size = slab_get_object_size(cache->slab_full, obj);
-	if(full_object_size) {
-		return full_object_size;
+	magazine->frees++;
+
+	if(magazine->cnt == SLAB_MAGAZINE_SIZE) {
+		magazine->flushes++;
+
+		cache_lock(cache);
+		for(size_t i = 0; i < SLAB_MAGAZINE_BATCH; i++) {
+			cache_push_obj(cache, magazine->objects[--magazine->cnt]);
+		}
+		cache_unlock(cache);
 	}
 
-	return 0;
+	magazine->objects[magazine->cnt++] = obj;
+
+	if(interrupts) {
+		asm volatile ("sti");
+	}
 }
 
-static int slab_free_object(struct slab *slab, void *obj) {
-	if(slab == NULL)
-		return 0;
+static void cache_init(struct cache *cache, const char *name, size_t size, size_t align) {
+	if(align < 8) {
+		align = 8;
+	}
 
-	spinlock_irqsave(&slab->cache->lock);
+	size_t object_size = ALIGN_UP(size, align);
+	size_t buffer_offset = ALIGN_UP(sizeof(struct slab), align < 16 ? 16 : align);
+
+	*cache = (struct cache) {
+		.size = size,
+		.object_size = object_size,
+		.objects_per_slab = (SLAB_SIZE - buffer_offset) / object_size,
+		.buffer_offset = buffer_offset,
+		.magazine = -1,
+		.name = name
+	};
+}
 
-	struct slab *root = slab;
+struct cache *slab_cache_create(const char *name, size_t size, size_t align) {
+	if(cache_cache.object_size == 0) {
+		cache_init(&cache_cache, "cache", sizeof(struct cache), 0);
+	}
 
-	while(slab) {
-		if(slab->buffer <= obj && (slab->buffer + slab->cache->object_size * slab->total_objects) > obj) {
-			size_t index = ((uintptr_t)obj - (uintptr_t)slab->buffer) / slab->cache->object_size;
-			if(BIT_TEST(slab->bitmap, index)) {
-				BIT_CLEAR(slab->bitmap, index);
-				slab->available_objects++;
-				spinrelease_irqsave(&root->cache->lock);
-				return 1;
-			}
-		}
+	struct cache *new_cache = cache_alloc_obj(&cache_cache, sizeof(struct cache), false);
+	cache_init(new_cache, name, size, align);
 
-		slab = slab->next;
+	if(magazine_cnt < SLAB_MAGAZINE_SLOTS) {
+		new_cache->magazine = magazine_cnt++;
 	}
 
-	spinrelease_irqsave(&root->cache->lock);
+	new_cache->next = root_cache;
+	root_cache = new_cache;
 
-	return 0;
+	return new_cache;
+}
+
+void *slab_cache_alloc(struct cache *cache) {
+	return cache_alloc_obj(cache, cache->size, true);
+}
+
+void *slab_cache_alloc_nozero(struct cache *cache) {
+	return cache_alloc_obj(cache, cache->size, false);
 }
 
-static int cache_free_object(struct cache *cache, void *obj) {
-	if(slab_free_object(cache->slab_partial, obj)) {
-		return 1;
-	} else if(slab_free_object(cache->slab_full, obj)) {
-		return 1;
+void slab_cache_free(struct cache *cache, void *obj) {
+	if(obj == NULL) {
+		return;
 	}
-	return 0;
+
+	cache_free_obj(cache, obj);
 }
 
-void slab_cache_create(const char *name, size_t object_size) {
-	struct cache cache = { 0 };
+void slab_init() {
+	static const char *class_names[SLAB_CLASS_CNT] = {
+		"alloc-32", "alloc-48", "alloc-64", "alloc-96", "alloc-128", "alloc-192",
+		"alloc-256", "alloc-384", "alloc-512", "alloc-768", "alloc-1024", "alloc-1536",
+		"alloc-2048", "alloc-3072", "alloc-4096", "alloc-6144", "alloc-8192"
+	};
+
+	for(size_t i = 0; i < SLAB_CLASS_CNT; i++) {
+		size_t size = 1ull << (i / 2 + SLAB_MIN_CLASS_SHIFT);
+		if(i % 2) {
+			size += size / 2;
+		}
 
-	cache.pages_per_slab = DIV_ROUNDUP(object_size * OBJECTS_PER_SLAB + sizeof(struct slab) + OBJECTS_PER_SLAB, PAGE_SIZE);
-	cache.object_size = object_size;
-	cache.name = name;
+		size_classes[i] = slab_cache_create(class_names[i], size, 0);
+	}
 
-	struct slab *root_slab = cache_alloc_slab(&cache);
+	task_cache = slab_cache_create("task", sizeof(struct task), SLAB_CACHE_LINE_SIZE);
+	page_cache = slab_cache_create("page", sizeof(struct page), 0);
+	frame_cache = slab_cache_create("frame", sizeof(struct frame), 0);
+	vfs_node_cache = slab_cache_create("vfs_node", sizeof(struct vfs_node), SLAB_CACHE_LINE_SIZE);
+	file_handle_cache = slab_cache_create("file_handle", sizeof(struct file_handle), SLAB_CACHE_LINE_SIZE);
+	fd_handle_cache = slab_cache_create("fd_handle", sizeof(struct fd_handle), 0);
+	waitq_trigger_cache = slab_cache_create("waitq_trigger", sizeof(struct waitq_trigger), SLAB_CACHE_LINE_SIZE);
+	radix_node_cache = slab_cache_create("radix_node", sizeof(struct radix_node), SLAB_CACHE_LINE_SIZE);
+	pcache_page_cache = slab_cache_create("pcache_page", sizeof(struct pcache_page), 0);
+}
 
-	*(struct cache*)root_slab->buffer = cache;
-	struct cache *new_cache = (struct cache*)root_slab->buffer;
+// anything past the largest class comes out of the vmalloc window instead of a physically
+// contiguous pmm run
 
-	root_slab->cache = new_cache;
-	root_slab->buffer += sizeof(struct cache);
-	root_slab->available_objects -= DIV_ROUNDUP(object_size, sizeof(struct cache));
-	root_slab->total_objects = root_slab->available_objects;
+static void *slab_large_alloc(size_t size, bool zero) {
+	void *addr = zero ? vmalloc(size) : vmalloc_nozero(size);
 
-	new_cache->slab_empty = root_slab;
-	new_cache->next = root_cache;
+	__atomic_add_fetch(&large_allocations, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&large_requested_bytes, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&large_allocated_bytes, ALIGN_UP(size, PAGE_SIZE), __ATOMIC_RELAXED);
 
-	root_cache = new_cache;
+	return addr;
 }
 
-void *alloc(size_t size) {
-	if(!size) {
-		return NULL;
+static size_t slab_object_size(void *obj) {
+	if(vmalloc_owns(obj)) {
+		return vmalloc_size(obj);
 	}
 
-	size_t round_size = pow2_roundup(size + 1);
-	if(round_size <= 16) {
-		round_size = 32;
+	struct slab *slab = slab_block(obj);
+
+	if(slab->magic == SLAB_MAGIC) {
+		return slab->cache->object_size;
 	}
 
-	struct cache *cache = root_cache;
+	return 0;
+}
 
-	while(cache) {
-		if(cache->object_size == round_size) {
-			return cache_alloc_obj(cache);
-		}
-		cache = cache->next;
+static size_t slab_size_class(size_t size) {
+	if(size <= SLAB_MIN_CLASS_SIZE) {
+		return 0;
 	}
 
-	panic("slab: returning null");
+	// the top bit of size - 1 picks the power of two, the bit below it picks between
+	// 1.5 * 2^k and 2^(k + 1)
+	size_t bits = size - 1;
+	size_t shift = 63 - __builtin_clzl(bits);
 
-	return NULL;
+	return 2 * (shift - SLAB_MIN_CLASS_SHIFT) + 1 + ((bits >> (shift - 1)) & 1);
 }
 
-void free(void *obj) {
-	return;
+static void *slab_alloc_size(size_t size, bool zero) {
+	if(!size) {
+		return NULL;
+	}
+
+	if(size > SLAB_MAX_OBJECT_SIZE) {
+		return slab_large_alloc(size, zero);
+	}
+
+	return cache_alloc_obj(size_classes[slab_size_class(size)], size, zero);
+}
 
+void *alloc(size_t size) {
+	return slab_alloc_size(size, true);
+}
+
+void *alloc_nozero(size_t size) {
+	return slab_alloc_size(size, false);
+}
+
+void free(void *obj) {
 	if(!obj)
 		return;
 
-	struct cache *cache = root_cache;
+	if(vmalloc_owns(obj)) {
+		vfree(obj);
+		return;
+	}
 
-	while(cache) {
-		if(cache_free_object(cache, obj)) {
-			return;
-		}
-		cache = cache->next;
+	struct slab *slab = slab_block(obj);
+
+	if(slab->magic != SLAB_MAGIC) {
+		print("slab: free of unknown object %x\n", (uintptr_t)obj);
+		return;
 	}
+
+	cache_free_obj(slab->cache, obj);
 }
 
 void *realloc(void *obj, size_t size) {
@@ -270,16 +520,12 @@ void *realloc(void *obj, size_t size) {
 		return alloc(size);
 	}
 
-	struct cache *cache = root_cache;
-	size_t object_size = 0;
-
-	while(cache) {
-		object_size = cache_get_object_size(cache, obj);	
-		if(object_size)
-			break;
-		cache = cache->next;
+	if(vmalloc_owns(obj) && size > SLAB_MAX_OBJECT_SIZE) { // large areas can usually grow in place
+		return vrealloc(obj, size);
 	}
 
+	size_t object_size = slab_object_size(obj);
+
 	if(object_size >= size) {
 		return obj;
 	}
@@ -291,3 +537,47 @@ void *realloc(void *obj, size_t size) {
 
 	return ret;
 }
+
+void slab_print_stats() {
+	for(struct cache *cache = root_cache; cache; cache = cache->next) {
+		size_t hits = 0, misses = 0, flushes = 0;
+		size_t allocations = cache->allocations, frees = cache->frees;
+
+		for(size_t i = 0; cache->magazine != -1 && i < cpu_local_list.length; i++) {
+			struct slab_magazine *magazine = &cpu_local_list.data[i]->slab_magazines[cache->magazine];
+
+			hits += magazine->hits;
+			misses += magazine->misses;
+			flushes += magazine->flushes;
+			allocations += magazine->allocations;
+			frees += magazine->frees;
+		}
+
+		print("slab: %s: object size %d slabs %d allocations %d frees %d in use %d\n",
+			cache->name, cache->object_size, cache->active_slabs, allocations, frees, allocations - frees);
+		print("slab: %s: magazine hits %d misses %d flushes %d lock acquisitions %d contended %d\n",
+			cache->name, hits, misses, flushes, cache->lock_acquisitions, cache->lock_contentions);
+	}
+}
+
+void slab_print_class_usage() {
+	for(size_t i = 0; i < SLAB_CLASS_CNT; i++) {
+		struct cache *cache = size_classes[i];
+
+		size_t allocations = cache->allocations;
+		size_t requested_bytes = cache->requested_bytes;
+
+		for(size_t j = 0; cache->magazine != -1 && j < cpu_local_list.length; j++) {
+			struct slab_magazine *magazine = &cpu_local_list.data[j]->slab_magazines[cache->magazine];
+
+			allocations += magazine->allocations;
+			requested_bytes += magazine->requested_bytes;
+		}
+
+		print("slab: %s: allocations %d requested %d bytes allocated %d bytes\n",
+			cache->name, allocations, requested_bytes, allocations * cache->object_size);
+	}
+
+	print("slab: large: allocations %d requested %d bytes allocated %d bytes\n",
+		large_allocations, large_requested_bytes, large_allocated_bytes);
+}
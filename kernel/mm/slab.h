@@ -3,7 +3,45 @@
 #include <stdint.h>
 #include <stddef.h>
 
-void slab_cache_create(const char *name, size_t object_size);
+#define SLAB_MAGAZINE_SIZE 16
+#define SLAB_MAGAZINE_BATCH 8
+#define SLAB_MAGAZINE_SLOTS 32
+
+#define SLAB_CACHE_LINE_SIZE 64
+
+struct cache;
+
+struct slab_magazine {
+	void *objects[SLAB_MAGAZINE_SIZE];
+	size_t cnt;
+
+	size_t hits;
+	size_t misses;
+	size_t flushes;
+
+	size_t allocations;
+	size_t requested_bytes;
+	size_t frees;
+};
+
+extern struct cache *task_cache;
+extern struct cache *page_cache;
+extern struct cache *frame_cache;
+extern struct cache *vfs_node_cache;
+extern struct cache *file_handle_cache;
+extern struct cache *fd_handle_cache;
+extern struct cache *waitq_trigger_cache;
+extern struct cache *radix_node_cache;
+extern struct cache *pcache_page_cache;
+
+void slab_init();
+struct cache *slab_cache_create(const char *name, size_t size, size_t align);
+void *slab_cache_alloc(struct cache *cache);
+void *slab_cache_alloc_nozero(struct cache *cache);
+void slab_cache_free(struct cache *cache, void *obj);
 void *alloc(size_t cnt);
+void *alloc_nozero(size_t cnt);
 void *realloc(void *obj, size_t size);
 void free(void *obj);
+void slab_print_stats();
+void slab_print_class_usage();
@@ -0,0 +1,173 @@
+#include <mm/swap.h>
+#include <mm/vmalloc.h>
+#include <fs/cdev.h>
+#include <debug.h>
+#include <cpu.h>
+#include <lock.h>
+
+// a single swap area split into page sized slots. each slot counts the swapped out ptes that
+// refer to it, fork duplicates the count instead of reading the page back in
+
+struct swap_device {
+	struct cdev *cdev;
+
+	size_t slot_cnt;
+	size_t free_cnt;
+	size_t hint; // where the next search for a free slot starts
+
+	uint16_t *slots; // users of each slot, 0 when free. slot 0 holds the swap header
+
+	struct spinlock lock;
+};
+
+struct swap_stats {
+	size_t writes;
+	size_t reads;
+	size_t write_errors;
+	size_t read_errors;
+	size_t full;
+};
+
+static struct swap_device swap_device;
+static struct swap_stats swap_stats;
+
+int swap_activate(struct cdev *cdev, size_t size) {
+	size_t slot_cnt = size / PAGE_SIZE;
+
+	if(swap_device.cdev || slot_cnt < 2 || cdev->bops == NULL) {
+		return -1;
+	}
+
+	uint16_t *slots = vmalloc(slot_cnt * sizeof(uint16_t));
+
+	spinlock_irqsave(&swap_device.lock);
+
+	swap_device.slots = slots;
+	swap_device.slot_cnt = slot_cnt;
+	swap_device.free_cnt = slot_cnt - 1;
+	swap_device.hint = 1;
+
+	__atomic_store_n(&swap_device.cdev, cdev, __ATOMIC_RELEASE);
+
+	spinrelease_irqsave(&swap_device.lock);
+
+	print("swap: %d KiB of swap on %x\n", (slot_cnt - 1) * PAGE_SIZE / 1024, cdev->rdev);
+
+	return 0;
+}
+
+bool swap_enabled() {
+	return __atomic_load_n(&swap_device.cdev, __ATOMIC_ACQUIRE) != NULL;
+}
+
+// the slot comes back busy until swap_unbusy, faults on it wait for the write to finish
+
+int64_t swap_alloc() {
+	if(!swap_enabled()) {
+		return -1;
+	}
+
+	spinlock_irqsave(&swap_device.lock);
+
+	if(swap_device.free_cnt == 0) {
+		spinrelease_irqsave(&swap_device.lock);
+		__atomic_add_fetch(&swap_stats.full, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	size_t slot = swap_device.hint;
+
+	while(swap_device.slots[slot]) {
+		if(++slot == swap_device.slot_cnt) {
+			slot = 1;
+		}
+	}
+
+	swap_device.slots[slot] = 1 | SWAP_SLOT_BUSY;
+	swap_device.free_cnt--;
+	swap_device.hint = slot + 1 == swap_device.slot_cnt ? 1 : slot + 1;
+
+	spinrelease_irqsave(&swap_device.lock);
+
+	return slot;
+}
+
+void swap_dup(uint64_t slot) {
+	spinlock_irqsave(&swap_device.lock);
+
+	if((swap_device.slots[slot] & SWAP_SLOT_MAX_REFS) == SWAP_SLOT_MAX_REFS) {
+		panic("swap: slot %x has too many users", slot);
+	}
+
+	swap_device.slots[slot]++;
+
+	spinrelease_irqsave(&swap_device.lock);
+}
+
+void swap_free(uint64_t slot) {
+	spinlock_irqsave(&swap_device.lock);
+
+	if((swap_device.slots[slot] & SWAP_SLOT_MAX_REFS) == 0) {
+		spinrelease_irqsave(&swap_device.lock);
+		print("swap: free of unused slot %x\n", slot);
+		return;
+	}
+
+	if(--swap_device.slots[slot] == 0) { // a busy slot is only released by swap_unbusy
+		swap_device.free_cnt++;
+	}
+
+	spinrelease_irqsave(&swap_device.lock);
+}
+
+bool swap_busy(uint64_t slot) {
+	return __atomic_load_n(&swap_device.slots[slot], __ATOMIC_ACQUIRE) & SWAP_SLOT_BUSY;
+}
+
+// the write that swap_alloc reserved the slot for is over
+
+void swap_unbusy(uint64_t slot) {
+	spinlock_irqsave(&swap_device.lock);
+
+	swap_device.slots[slot] &= ~(SWAP_SLOT_BUSY);
+
+	if(swap_device.slots[slot] == 0) {
+		swap_device.free_cnt++;
+	}
+
+	spinrelease_irqsave(&swap_device.lock);
+}
+
+int swap_write(uint64_t slot, uint64_t frame) {
+	struct cdev *cdev = swap_device.cdev;
+
+	if(cdev->bops->write(cdev, (void*)(frame + HIGH_VMA), PAGE_SIZE, slot * PAGE_SIZE) == -1) {
+		__atomic_add_fetch(&swap_stats.write_errors, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	__atomic_add_fetch(&swap_stats.writes, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int swap_read(uint64_t slot, uint64_t frame) {
+	struct cdev *cdev = swap_device.cdev;
+
+	if(cdev->bops->read(cdev, (void*)(frame + HIGH_VMA), PAGE_SIZE, slot * PAGE_SIZE) == -1) {
+		__atomic_add_fetch(&swap_stats.read_errors, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	__atomic_add_fetch(&swap_stats.reads, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void swap_print_stats() {
+	struct swap_stats *stats = &swap_stats;
+
+	print("swap: slots %d free %d written %d read %d write errors %d read errors %d full %d\n",
+		swap_device.slot_cnt, swap_device.free_cnt, stats->writes, stats->reads,
+		stats->write_errors, stats->read_errors, stats->full);
+}
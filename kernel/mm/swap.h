@@ -0,0 +1,20 @@
+#pragma once
+
+#include <types.h>
+
+#define SWAP_MBR_TYPE 0x82 // linux swap partitions are picked up automatically
+#define SWAP_SLOT_BUSY 0x8000 // set while the slot is still being written out
+#define SWAP_SLOT_MAX_REFS 0x7fff
+
+struct cdev;
+
+int swap_activate(struct cdev *cdev, size_t size);
+bool swap_enabled();
+int64_t swap_alloc();
+void swap_dup(uint64_t slot);
+void swap_free(uint64_t slot);
+bool swap_busy(uint64_t slot);
+void swap_unbusy(uint64_t slot);
+int swap_write(uint64_t slot, uint64_t frame);
+int swap_read(uint64_t slot, uint64_t frame);
+void swap_print_stats();
@@ -0,0 +1,231 @@
+#include <mm/tlb.h>
+#include <mm/vmm.h>
+#include <int/apic.h>
+#include <int/idt.h>
+#include <sched/smp.h>
+#include <debug.h>
+#include <cpu.h>
+#include <lock.h>
+
+// invalidations are collected into a tlb_batch and sent out in one go. only cpus that have the
+// address space loaded right now are interrupted, the rest pick the change up through the pcid
+// generation check in vmm_init_page_table
+
+struct tlb_request {
+	struct page_table *page_table;
+	uintptr_t addrs[TLB_BATCH_MAX];
+	size_t cnt;
+	bool full;
+};
+
+struct tlb_stats {
+	size_t shootdowns;
+	size_t ipis;
+	size_t pages;
+	size_t full_flushes;
+};
+
+static const char *tlb_reason_names[TLB_REASON_CNT] = {
+	"unmap", "munmap", "fork", "cow", "vmalloc", "split", "reclaim", "mremap", "mprotect"
+};
+
+static int tlb_vector = -1;
+
+static char tlb_lock;
+static struct tlb_request tlb_request;
+static size_t tlb_acks_pending;
+
+static struct tlb_stats tlb_stats[TLB_REASON_CNT];
+static size_t tlb_received;
+
+// before smp is up there is no per cpu data and whatever is being changed counts as loaded
+
+static void tlb_flush_local(struct page_table *page_table, const uintptr_t *addrs, size_t cnt, bool full) {
+	struct cpu_local *cpu_local = CORE_LOCAL;
+
+	if(page_table == &kernel_mappings) { // kernel mappings are global, only a pge toggle drops all of them
+		if(full) {
+			uint64_t cr4;
+			asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+			asm volatile ("mov %0, %%cr4" :: "r"(cr4 & ~(1 << 7)) : "memory");
+			asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+			return;
+		}
+	} else if(cpu_local && __atomic_load_n(&cpu_local->active_page_table, __ATOMIC_ACQUIRE) != page_table) {
+		return;
+	} else if(full) {
+		uint64_t cr3;
+		asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+		asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+		return;
+	}
+
+	for(size_t i = 0; i < cnt; i++) {
+		invlpg(addrs[i]);
+	}
+}
+
+static void tlb_service() {
+	struct cpu_local *cpu_local = CORE_LOCAL;
+
+	if(!__atomic_exchange_n(&cpu_local->tlb_shootdown_pending, false, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	tlb_flush_local(tlb_request.page_table, tlb_request.addrs, tlb_request.cnt, tlb_request.full);
+
+	__atomic_add_fetch(&tlb_received, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&tlb_acks_pending, 1, __ATOMIC_RELEASE);
+}
+
+static void tlb_shootdown_handler(struct registers*, void*) {
+	tlb_service();
+}
+
+// for loops that wait on another cpu with interrupts possibly off, that cpu may be waiting on us.
+// every spinlock spins through here, so it stays cheap and works before smp is up
+
+void tlb_poll() {
+	struct cpu_local *cpu_local = CORE_LOCAL;
+
+	if(cpu_local && __atomic_load_n(&cpu_local->tlb_shootdown_pending, __ATOMIC_RELAXED)) {
+		tlb_service();
+	}
+}
+
+void tlb_init() {
+	tlb_vector = idt_alloc_vector(tlb_shootdown_handler, NULL);
+	if(tlb_vector == -1) {
+		panic("tlb: unable to allocate a shootdown vector");
+	}
+}
+
+void tlb_batch_init(struct tlb_batch *batch, struct page_table *page_table, int reason) {
+	batch->page_table = page_table;
+	batch->reason = reason;
+	batch->cnt = 0;
+	batch->full = false;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t vaddr) {
+	if(batch->cnt == TLB_BATCH_MAX) {
+		batch->full = true;
+		return;
+	}
+
+	batch->addrs[batch->cnt++] = vaddr;
+}
+
+void tlb_batch_add_range(struct tlb_batch *batch, uintptr_t vaddr, size_t page_cnt) {
+	if(batch->cnt + page_cnt > TLB_BATCH_MAX) {
+		batch->full = true;
+		return;
+	}
+
+	for(size_t i = 0; i < page_cnt; i++) {
+		batch->addrs[batch->cnt++] = vaddr + i * PAGE_SIZE;
+	}
+}
+
+// the calling cpu drops its own stale entries first, the frames behind them may be freed as
+// soon as this returns
+
+void tlb_batch_flush(struct tlb_batch *batch) {
+	if(batch->cnt == 0 && !batch->full) {
+		return;
+	}
+
+	tlb_flush_local(batch->page_table, batch->addrs, batch->cnt, batch->full);
+
+	if(tlb_vector == -1 || CORE_LOCAL == NULL) {
+		batch->cnt = 0;
+		batch->full = false;
+		return;
+	}
+
+	struct tlb_stats *stats = &tlb_stats[batch->reason];
+	struct cpu_local *self = CORE_LOCAL;
+
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
+
+	// a cpu spinning here with interrupts off still has to answer whoever holds the lock
+	while(__atomic_test_and_set(&tlb_lock, __ATOMIC_ACQUIRE)) {
+		tlb_service();
+		asm volatile ("pause");
+	}
+
+	tlb_request.page_table = batch->page_table;
+	tlb_request.cnt = batch->cnt;
+	tlb_request.full = batch->full;
+
+	for(size_t i = 0; i < batch->cnt; i++) {
+		tlb_request.addrs[i] = batch->addrs[i];
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // page table writes before we look at who has the table loaded
+
+	size_t ipis = 0;
+
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct cpu_local *cpu_local = cpu_local_list.data[i];
+
+		if(cpu_local == self) {
+			continue;
+		}
+
+		if(batch->page_table != &kernel_mappings &&
+			__atomic_load_n(&cpu_local->active_page_table, __ATOMIC_SEQ_CST) != batch->page_table) {
+			continue;
+		}
+
+		__atomic_add_fetch(&tlb_acks_pending, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&cpu_local->tlb_shootdown_pending, true, __ATOMIC_RELEASE);
+
+		while(xapic_read(XAPIC_ICR_OFF) & (1 << 12));
+
+		xapic_write(XAPIC_ICR_OFF + 0x10, cpu_local->apic_id << 24);
+		xapic_write(XAPIC_ICR_OFF, tlb_vector);
+
+		ipis++;
+	}
+
+	while(__atomic_load_n(&tlb_acks_pending, __ATOMIC_ACQUIRE)) {
+		asm volatile ("pause");
+	}
+
+	__atomic_clear(&tlb_lock, __ATOMIC_RELEASE);
+
+	if(interrupts) {
+		asm volatile ("sti");
+	}
+
+	__atomic_add_fetch(&stats->shootdowns, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->ipis, ipis, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->pages, batch->cnt, __ATOMIC_RELAXED);
+	if(batch->full) {
+		__atomic_add_fetch(&stats->full_flushes, 1, __ATOMIC_RELAXED);
+	}
+
+	batch->cnt = 0;
+	batch->full = false;
+}
+
+void tlb_shootdown(struct page_table *page_table, uintptr_t vaddr, int reason) {
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, page_table, reason);
+	tlb_batch_add(&batch, vaddr);
+	tlb_batch_flush(&batch);
+}
+
+void tlb_print_stats() {
+	for(size_t i = 0; i < TLB_REASON_CNT; i++) {
+		struct tlb_stats *stats = &tlb_stats[i];
+
+		print("tlb: %s: shootdowns %d ipis %d pages %d full flushes %d\n",
+			tlb_reason_names[i], stats->shootdowns, stats->ipis, stats->pages, stats->full_flushes);
+	}
+
+	print("tlb: shootdowns received %d\n", tlb_received);
+}
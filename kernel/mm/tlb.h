@@ -0,0 +1,38 @@
+#pragma once
+
+#include <types.h>
+
+#define TLB_BATCH_MAX 32 // past this many pages a full flush is cheaper than invlpg
+
+enum {
+	TLB_REASON_UNMAP,
+	TLB_REASON_MUNMAP,
+	TLB_REASON_FORK,
+	TLB_REASON_COW,
+	TLB_REASON_VMALLOC,
+	TLB_REASON_SPLIT,
+	TLB_REASON_RECLAIM,
+	TLB_REASON_MREMAP,
+	TLB_REASON_MPROTECT,
+	TLB_REASON_CNT
+};
+
+struct page_table;
+
+struct tlb_batch {
+	struct page_table *page_table;
+	int reason;
+
+	uintptr_t addrs[TLB_BATCH_MAX];
+	size_t cnt;
+	bool full;
+};
+
+void tlb_init();
+void tlb_batch_init(struct tlb_batch *batch, struct page_table *page_table, int reason);
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t vaddr);
+void tlb_batch_add_range(struct tlb_batch *batch, uintptr_t vaddr, size_t page_cnt);
+void tlb_batch_flush(struct tlb_batch *batch);
+void tlb_shootdown(struct page_table *page_table, uintptr_t vaddr, int reason);
+void tlb_poll();
+void tlb_print_stats();
@@ -0,0 +1,252 @@
+#include <mm/vmalloc.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <mm/tlb.h>
+#include <string.h>
+#include <debug.h>
+#include <cpu.h>
+#include <lock.h>
+
+// large buffers are built from discontiguous frames mapped into a window that every address
+// space shares with kernel_mappings (see vmm_default_table), so they never need a physically
+// contiguous run
+
+#define VMALLOC_FLAGS (VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_G | VMM_FLAGS_NX)
+#define VMALLOC_MAP_BATCH 64
+
+struct vmalloc_area {
+	uintptr_t base;
+	size_t page_cnt; // mapped pages
+	size_t reserved; // pages of address space held, never less than page_cnt
+
+	struct vmalloc_area *next;
+};
+
+static struct vmalloc_area *area_list; // sorted by base
+static struct spinlock vmalloc_lock;
+
+static size_t vmalloc_mapped_pages;
+static size_t vmalloc_inplace_grows;
+static size_t vmalloc_moved_grows;
+
+static struct vmalloc_area *vmalloc_find(uintptr_t base) {
+	for(struct vmalloc_area *area = area_list; area; area = area->next) {
+		if(area->base == base) {
+			return area;
+		}
+	}
+
+	return NULL;
+}
+
+static uintptr_t vmalloc_area_end(struct vmalloc_area *area) {
+	return area->base + (area->reserved + VMALLOC_GUARD_PAGES) * PAGE_SIZE;
+}
+
+static struct vmalloc_area *vmalloc_reserve(size_t page_cnt) {
+	struct vmalloc_area *new_area = alloc(sizeof(struct vmalloc_area));
+
+	spinlock_irqsave(&vmalloc_lock);
+
+	uintptr_t cursor = VMALLOC_BASE;
+	struct vmalloc_area **link = &area_list;
+
+	for(; *link; link = &(*link)->next) { // first fit between the existing areas
+		if((*link)->base - cursor >= (page_cnt + VMALLOC_GUARD_PAGES) * PAGE_SIZE) {
+			break;
+		}
+
+		cursor = vmalloc_area_end(*link);
+	}
+
+	if(*link == NULL && VMALLOC_LIMIT - cursor < (page_cnt + VMALLOC_GUARD_PAGES) * PAGE_SIZE) {
+		spinrelease_irqsave(&vmalloc_lock);
+		free(new_area);
+		return NULL;
+	}
+
+	*new_area = (struct vmalloc_area) {
+		.base = cursor,
+		.page_cnt = page_cnt,
+		.reserved = page_cnt,
+		.next = *link
+	};
+
+	*link = new_area;
+
+	spinrelease_irqsave(&vmalloc_lock);
+
+	return new_area;
+}
+
+static void vmalloc_map(uintptr_t vaddr, size_t page_cnt, bool zero) {
+	uint64_t frames[VMALLOC_MAP_BATCH];
+
+	for(size_t i = 0; i < page_cnt;) {
+		size_t cnt = page_cnt - i < VMALLOC_MAP_BATCH ? page_cnt - i : VMALLOC_MAP_BATCH;
+
+		if(pmm_alloc_batch(frames, cnt, zero) != cnt) {
+			panic("vmalloc: out of memory");
+		}
+
+		vmm_map_pages(&kernel_mappings, vaddr + i * PAGE_SIZE, frames, cnt, VMALLOC_FLAGS);
+
+		i += cnt;
+	}
+
+	__atomic_add_fetch(&vmalloc_mapped_pages, page_cnt, __ATOMIC_RELAXED);
+}
+
+// frames only go back to the pmm once no cpu can still reach them through a stale translation
+
+static void vmalloc_unmap(uintptr_t vaddr, size_t page_cnt) {
+	struct tlb_batch batch;
+	uint64_t old[TLB_BATCH_MAX];
+
+	tlb_batch_init(&batch, &kernel_mappings, TLB_REASON_VMALLOC);
+
+	for(size_t i = 0; i < page_cnt; i += TLB_BATCH_MAX) {
+		size_t cnt = page_cnt - i < TLB_BATCH_MAX ? page_cnt - i : TLB_BATCH_MAX;
+
+		vmm_unmap_pages(&kernel_mappings, vaddr + i * PAGE_SIZE, cnt, old, &batch);
+		tlb_batch_flush(&batch);
+
+		for(size_t j = 0; j < cnt; j++) {
+			if(old[j] & VMM_FLAGS_P) {
+				pmm_free(old[j] & ~(0xfff | VMM_FLAGS_NX), 1);
+			}
+		}
+	}
+
+	__atomic_sub_fetch(&vmalloc_mapped_pages, page_cnt, __ATOMIC_RELAXED);
+}
+
+static void *vmalloc_alloc(size_t size, bool zero) {
+	if(size == 0) {
+		return NULL;
+	}
+
+	size_t page_cnt = DIV_ROUNDUP(size, PAGE_SIZE);
+
+	struct vmalloc_area *area = vmalloc_reserve(page_cnt);
+	if(area == NULL) {
+		panic("vmalloc: out of address space");
+	}
+
+	vmalloc_map(area->base, page_cnt, zero);
+
+	return (void*)area->base;
+}
+
+void *vmalloc(size_t size) {
+	return vmalloc_alloc(size, true);
+}
+
+void *vmalloc_nozero(size_t size) {
+	return vmalloc_alloc(size, false);
+}
+
+void vfree(void *addr) {
+	if(addr == NULL) {
+		return;
+	}
+
+	spinlock_irqsave(&vmalloc_lock);
+
+	struct vmalloc_area **link = &area_list;
+	while(*link && (*link)->base != (uintptr_t)addr) {
+		link = &(*link)->next;
+	}
+
+	struct vmalloc_area *area = *link;
+	if(area == NULL) {
+		spinrelease_irqsave(&vmalloc_lock);
+		print("vmalloc: free of unknown area %x\n", (uintptr_t)addr);
+		return;
+	}
+
+	*link = area->next;
+
+	spinrelease_irqsave(&vmalloc_lock);
+
+	vmalloc_unmap(area->base, area->page_cnt);
+	free(area);
+}
+
+size_t vmalloc_size(void *addr) {
+	spinlock_irqsave(&vmalloc_lock);
+	struct vmalloc_area *area = vmalloc_find((uintptr_t)addr);
+	size_t size = area ? area->page_cnt * PAGE_SIZE : 0;
+	spinrelease_irqsave(&vmalloc_lock);
+
+	return size;
+}
+
+void *vrealloc(void *addr, size_t size) {
+	if(addr == NULL) {
+		return vmalloc(size);
+	}
+
+	size_t page_cnt = DIV_ROUNDUP(size, PAGE_SIZE);
+
+	spinlock_irqsave(&vmalloc_lock);
+
+	struct vmalloc_area *area = vmalloc_find((uintptr_t)addr);
+	if(area == NULL) {
+		spinrelease_irqsave(&vmalloc_lock);
+		print("vmalloc: realloc of unknown area %x\n", (uintptr_t)addr);
+		return NULL;
+	}
+
+	size_t old_cnt = area->page_cnt;
+
+	if(page_cnt <= old_cnt) { // shrinking hands the tail frames back but keeps the address space
+		area->page_cnt = page_cnt;
+		spinrelease_irqsave(&vmalloc_lock);
+
+		vmalloc_unmap(area->base + page_cnt * PAGE_SIZE, old_cnt - page_cnt);
+
+		return addr;
+	}
+
+	uintptr_t limit = area->next ? area->next->base : VMALLOC_LIMIT;
+
+	if(area->base + (page_cnt + VMALLOC_GUARD_PAGES) * PAGE_SIZE <= limit) { // the gap behind us is free, grow in place
+		if(page_cnt > area->reserved) {
+			area->reserved = page_cnt;
+		}
+		area->page_cnt = page_cnt;
+		vmalloc_inplace_grows++;
+
+		spinrelease_irqsave(&vmalloc_lock);
+
+		vmalloc_map(area->base + old_cnt * PAGE_SIZE, page_cnt - old_cnt, true);
+
+		return addr;
+	}
+
+	vmalloc_moved_grows++;
+
+	spinrelease_irqsave(&vmalloc_lock);
+
+	void *ret = vmalloc(size);
+
+	memcpy64(ret, addr, old_cnt * PAGE_SIZE / 8);
+	vfree(addr);
+
+	return ret;
+}
+
+void vmalloc_print_stats() {
+	size_t area_cnt = 0;
+
+	spinlock_irqsave(&vmalloc_lock);
+	for(struct vmalloc_area *area = area_list; area; area = area->next) {
+		area_cnt++;
+	}
+	spinrelease_irqsave(&vmalloc_lock);
+
+	print("vmalloc: areas %d mapped pages %d in place grows %d moved grows %d\n",
+		area_cnt, vmalloc_mapped_pages, vmalloc_inplace_grows, vmalloc_moved_grows);
+}
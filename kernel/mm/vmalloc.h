@@ -0,0 +1,18 @@
+#pragma once
+
+#include <types.h>
+
+#define VMALLOC_BASE 0xffffc90000000000ull
+#define VMALLOC_LIMIT (VMALLOC_BASE + 0x8000000000ull) // one pml4 slot
+#define VMALLOC_GUARD_PAGES 1
+
+static inline bool vmalloc_owns(const void *addr) {
+	return (uintptr_t)addr >= VMALLOC_BASE && (uintptr_t)addr < VMALLOC_LIMIT;
+}
+
+void *vmalloc(size_t size);
+void *vmalloc_nozero(size_t size);
+void *vrealloc(void *addr, size_t size);
+void vfree(void *addr);
+size_t vmalloc_size(void *addr);
+void vmalloc_print_stats();
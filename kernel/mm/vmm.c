@@ -1,5 +1,8 @@
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <mm/tlb.h>
+#include <mm/pcache.h>
+#include <mm/swap.h>
 #include <cpu.h>
 #include <string.h>
 #include <sched/sched.h>
@@ -38,6 +41,267 @@ static struct pml_indices compute_table_indices(uintptr_t vaddr) {
 
 struct page_table kernel_mappings;
 
+static void vmm_list_table(struct page_table *page_table);
+static void vmm_alloc_frames(uint64_t *frames, size_t cnt, bool zero);
+
+// read faults on anonymous memory map this frame read only and cow, the first write replaces it
+// with a private frame without copying anything
+uint64_t vmm_zero_frame;
+
+// narrowing or moving a translation has to reach the copies of this table cached under pcids
+// that are not loaded right now, those are flushed the next time they are loaded
+
+static void vmm_tlb_stale(struct page_table *page_table) {
+	__atomic_add_fetch(&page_table->tlb_generation, 1, __ATOMIC_RELEASE);
+}
+
+#define VMM_HUGE_1G_SIZE 0x40000000
+#define VMM_HUGE_1G_ADDR_MASK 0x000fffffc0000000ull
+
+// carve a 1GiB page into 2MiB pages so that a finer mapping can be placed inside it, the
+// translation itself does not change
+
+static void vmm_split_huge(uint64_t *entry) {
+	uint64_t pml2_addr = pmm_alloc(1, 1);
+	uint64_t *pml2 = (uint64_t*)(pml2_addr + HIGH_VMA);
+
+	uint64_t base = *entry & VMM_HUGE_1G_ADDR_MASK;
+	uint64_t flags = *entry & (0xfff | VMM_FLAGS_NX);
+
+	for(size_t i = 0; i < 512; i++) {
+		pml2[i] = (base + i * 0x200000) | flags;
+	}
+
+	*entry = pml2_addr | (flags & PML3_FLAGS_MASK);
+}
+
+// fork hands the child the parent's pml1 tables as they are, together with the block of page
+// records describing each of them. the pml2 entries on both sides lose write access and carry
+// VMM_PT_COW_FLAG, a table and its records only get copied once one side writes into its 2MiB
+// range or changes a mapping inside it. records are only ever added or removed in a block the
+// address space holds alone, a table without a block has one owner
+
+struct vmm_page_block {
+	struct page *pages[512];
+	size_t cnt;
+
+	int refcnt; // address spaces holding the block and the pml1 table that goes with it
+	struct spinlock lock;
+};
+
+static struct vmm_page_block *vmm_page_block(struct page_table *page_table, uintptr_t vaddr) {
+	return radix_tree_search(&page_table->pages, vaddr >> 21);
+}
+
+struct page *vmm_page_search(struct page_table *page_table, uintptr_t vaddr) {
+	struct vmm_page_block *block = vmm_page_block(page_table, vaddr);
+	if(block == NULL) {
+		return NULL;
+	}
+
+	struct page *page = block->pages[(vaddr >> 12) & 0x1ff];
+	if(page) {
+		return page;
+	}
+
+	page = block->pages[0];
+
+	return page && page->size == VMM_HUGE_PAGE_SIZE ? page : NULL;
+}
+
+void vmm_page_insert(struct page_table *page_table, struct page *page) {
+	struct vmm_page_block *block = vmm_page_block(page_table, page->vaddr);
+
+	if(block == NULL) {
+		block = alloc(sizeof(struct vmm_page_block));
+		block->refcnt = 1;
+		radix_tree_insert(&page_table->pages, page->vaddr >> 21, block);
+	} else if(block->refcnt > 1) {
+		panic("vmm: page record added to a shared table at %x", page->vaddr);
+	}
+
+	size_t index = (page->vaddr >> 12) & 0x1ff;
+
+	if(block->pages[index] == NULL) {
+		block->cnt++;
+	}
+
+	block->pages[index] = page;
+}
+
+struct page *vmm_page_delete(struct page_table *page_table, uintptr_t vaddr) {
+	struct vmm_page_block *block = vmm_page_block(page_table, vaddr);
+	if(block == NULL) {
+		return NULL;
+	}
+
+	size_t index = (vaddr >> 12) & 0x1ff;
+
+	struct page *page = block->pages[index];
+	if(page == NULL) {
+		return NULL;
+	}
+
+	if(block->refcnt > 1) {
+		panic("vmm: page record removed from a shared table at %x", vaddr);
+	}
+
+	block->pages[index] = NULL;
+
+	if(--block->cnt == 0) {
+		radix_tree_delete(&page_table->pages, vaddr >> 21);
+		free(block);
+	}
+
+	return page;
+}
+
+struct page *vmm_page_next(struct page_table *page_table, uintptr_t *vaddr) {
+	uint64_t first = *vaddr >> 21;
+	uint64_t index = first;
+
+	struct vmm_page_block *block;
+
+	for(; (block = radix_tree_next(&page_table->pages, &index)); index++) {
+		for(size_t i = index == first ? (*vaddr >> 12) & 0x1ff : 0; i < 512; i++) {
+			if(block->pages[i]) {
+				*vaddr = (index << 21) | (i << 12);
+				return block->pages[i];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// called by fork with the parent's lock held, returns the number of records the child now shares
+
+static size_t vmm_share_block(struct page_table *parent, struct page_table *child, uintptr_t vaddr) {
+	struct vmm_page_block *block = vmm_page_block(parent, vaddr);
+
+	if(block == NULL) { // an empty table still needs its holders counted
+		block = alloc(sizeof(struct vmm_page_block));
+		block->refcnt = 1;
+		radix_tree_insert(&parent->pages, vaddr >> 21, block);
+	}
+
+	spinlock_irqsave(&block->lock);
+	block->refcnt++;
+	spinrelease_irqsave(&block->lock);
+
+	radix_tree_insert(&child->pages, vaddr >> 21, block);
+
+	return block->cnt;
+}
+
+// the records for the side that takes a private copy of a table, pml1 being that copy. each of
+// them holds a reference on its frame just as the records of the side staying behind do
+
+static struct vmm_page_block *vmm_copy_block(struct vmm_page_block *block, uint64_t *pml1) {
+	struct vmm_page_block *copy = alloc(sizeof(struct vmm_page_block));
+	copy->refcnt = 1;
+
+	for(size_t i = 0; i < 512; i++) {
+		struct page *page = block->pages[i];
+		if(page == NULL) {
+			continue;
+		}
+
+		struct page *new_page = slab_cache_alloc_nozero(page_cache);
+
+		*new_page = *page;
+		new_page->pml_entry = &pml1[i];
+
+		(*page->reference)++;
+
+		if(page->cached) {
+			pcache_dup(page->cached);
+		}
+
+		if((page->flags & VMM_SWAP_FLAG) && (pml1[i] & VMM_SWAP_FLAG)) {
+			swap_dup((pml1[i] & VMM_PTE_ADDR_MASK) >> 12);
+		}
+
+		if(pml1[i] & VMM_COW_FLAG) {
+			new_page->flags = (new_page->flags & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+		}
+
+		copy->pages[i] = new_page;
+		copy->cnt++;
+	}
+
+	return copy;
+}
+
+static size_t vmm_unshared_copies;
+static size_t vmm_unshared_reuses;
+
+// called with the page table lock held. returns true when the pml2 entry changed, the caller
+// then owes the other cpus running this address space a shootdown once the lock is dropped
+
+static bool vmm_unshare_table(struct page_table *page_table, uint64_t *pml2_entry, uintptr_t vaddr) {
+	if((*pml2_entry & VMM_FLAGS_P) == 0 || (*pml2_entry & VMM_FLAGS_PS) || (*pml2_entry & VMM_PT_COW_FLAG) == 0) {
+		return false;
+	}
+
+	uint64_t *pml1 = (uint64_t*)((*pml2_entry & ~(0xfff)) + HIGH_VMA);
+
+	struct vmm_page_block *block = vmm_page_block(page_table, vaddr);
+	struct vmm_page_block *copy = NULL;
+	uint64_t table = 0;
+
+	// the other holders wait on the block lock, none of them changes the records while they
+	// are copied or takes the table as its own before this side has let go of it
+	if(block) {
+		spinlock_irqsave(&block->lock);
+
+		if(block->refcnt > 1) {
+			// the frames below stay shared after the copy, so from here on they break cow page by page
+			for(size_t i = 0; i < 512; i++) {
+				if((pml1[i] & VMM_FLAGS_P) && (pml1[i] & VMM_SHARE_FLAG) == 0) {
+					pml1[i] = (pml1[i] & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+				}
+			}
+
+			table = pmm_alloc_nozero(1, 1);
+			uint64_t *new_pml1 = (uint64_t*)(table + HIGH_VMA);
+
+			memcpy64(new_pml1, pml1, 512);
+
+			copy = vmm_copy_block(block, new_pml1);
+			block->refcnt--;
+		}
+
+		spinrelease_irqsave(&block->lock);
+	}
+
+	if(copy) {
+		radix_tree_insert(&page_table->pages, vaddr >> 21, copy);
+
+		*pml2_entry = table | (*pml2_entry & 0xfff & ~(VMM_PT_COW_FLAG)) | VMM_FLAGS_RW;
+		vmm_unshared_copies++;
+	} else { // everyone else already took a copy, the table is ours
+		*pml2_entry = (*pml2_entry & ~(VMM_PT_COW_FLAG)) | VMM_FLAGS_RW;
+		vmm_unshared_reuses++;
+	}
+
+	vmm_tlb_stale(page_table);
+	invlpg(vaddr);
+
+	return true;
+}
+
+// drops the lock around the shootdown so that the rest of the caller never writes into a table
+// another cpu may still be walking through a stale pml2 entry
+
+static void vmm_unshare_locked(struct page_table *page_table, uint64_t *pml2_entry, uintptr_t vaddr) {
+	if(vmm_unshare_table(page_table, pml2_entry, vaddr)) {
+		spinrelease_irqsave(&page_table->lock);
+		tlb_shootdown(page_table, vaddr, TLB_REASON_COW);
+		spinlock_irqsave(&page_table->lock);
+	}
+}
+
 static uint64_t *pml4_map_page(struct page_table *page_table, uintptr_t vaddr, uint64_t paddr, uint64_t flags) {
 	struct pml_indices pml_indices = compute_table_indices(vaddr);
 	spinlock_irqsave(&page_table->lock);
@@ -52,20 +316,30 @@ static uint64_t *pml4_map_page(struct page_table *page_table, uintptr_t vaddr, u
 		pml3[pml_indices.pml3_index] = pmm_alloc(1, 1) | (flags & PML3_FLAGS_MASK) | VMM_FLAGS_RW;
 	}
 
+	if(pml3[pml_indices.pml3_index] & VMM_FLAGS_PS) {
+		vmm_split_huge(&pml3[pml_indices.pml3_index]);
+	}
+
 	uint64_t *pml2 = (uint64_t*)((pml3[pml_indices.pml3_index] & ~(0xfff)) + HIGH_VMA);
 
 	if(flags & VMM_FLAGS_PS) {
 		pml2[pml_indices.pml2_index] = paddr | flags;
 		spinrelease_irqsave(&page_table->lock);
-		return NULL;
+		return &pml2[pml_indices.pml2_index];
 	}
 
+	vmm_unshare_locked(page_table, &pml2[pml_indices.pml2_index], vaddr);
+
 	if((pml2[pml_indices.pml2_index] & VMM_FLAGS_P) == 0) {
 		pml2[pml_indices.pml2_index] = pmm_alloc(1, 1) | (flags & PML2_FLAGS_MASK) | VMM_FLAGS_RW;
 	}
 
 	uint64_t *pml1 = (uint64_t*)((pml2[pml_indices.pml2_index] & ~(0xfff)) + HIGH_VMA);
 
+	if(pml1[pml_indices.pml1_index] & VMM_FLAGS_P) {
+		vmm_tlb_stale(page_table);
+	}
+
 	pml1[pml_indices.pml1_index] = paddr | flags;
 
 	spinrelease_irqsave(&page_table->lock);
@@ -90,10 +364,19 @@ static size_t pml4_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 		return 0;
 	}
 
+	if(pml3[pml_indices.pml3_index] & VMM_FLAGS_PS) {
+		pml3[pml_indices.pml3_index] &= ~(VMM_FLAGS_P);
+		vmm_tlb_stale(page_table);
+		invlpg(vaddr);
+		spinrelease_irqsave(&page_table->lock);
+		return VMM_HUGE_1G_SIZE;
+	}
+
 	uint64_t *pml2 = (uint64_t*)((pml3[pml_indices.pml3_index] & ~(0xfff)) + HIGH_VMA);
 
 	if((pml2[pml_indices.pml2_index] & 0xfff) & VMM_FLAGS_PS) {
 		pml2[pml_indices.pml2_index] &= ~(VMM_FLAGS_P);
+		vmm_tlb_stale(page_table);
 		invlpg(vaddr);
 		spinrelease_irqsave(&page_table->lock);
 		return 0x200000;
@@ -104,9 +387,12 @@ static size_t pml4_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 		return 0;
 	}
 
+	vmm_unshare_locked(page_table, &pml2[pml_indices.pml2_index], vaddr);
+
 	uint64_t *pml1 = (uint64_t*)((pml2[pml_indices.pml2_index] & ~(0xfff)) + HIGH_VMA);
 
-	pml1[pml_indices.pml1_index] &= ~(VMM_FLAGS_P);
+	pml1[pml_indices.pml1_index] &= ~(VMM_FLAGS_P | VMM_SWAP_FLAG); // a stale slot must never be read back in
+	vmm_tlb_stale(page_table);
 	invlpg(vaddr);
 
 	spinrelease_irqsave(&page_table->lock);
@@ -131,6 +417,11 @@ static uint64_t *pml4_lowest_level(struct page_table *page_table, uintptr_t vadd
 		return NULL;
 	}
 
+	if(pml3[pml_indices.pml3_index] & VMM_FLAGS_PS) {
+		spinrelease_irqsave(&page_table->lock);
+		return &pml3[pml_indices.pml3_index];
+	}
+
 	uint64_t *pml2 = (uint64_t*)((pml3[pml_indices.pml3_index] & ~(0xfff)) + HIGH_VMA);
 
 	if(pml2[pml_indices.pml2_index] & VMM_FLAGS_PS) {
@@ -174,6 +465,11 @@ static uint64_t *pml5_lowest_level(struct page_table *page_table, uintptr_t vadd
 		return NULL;
 	}
 
+	if(pml3[pml_indices.pml3_index] & VMM_FLAGS_PS) {
+		spinrelease_irqsave(&page_table->lock);
+		return &pml3[pml_indices.pml3_index];
+	}
+
 	uint64_t *pml2 = (uint64_t*)((pml3[pml_indices.pml3_index] & ~(0xfff)) + HIGH_VMA);
 
 	if(pml2[pml_indices.pml2_index] & VMM_FLAGS_PS) {
@@ -214,20 +510,30 @@ static uint64_t *pml5_map_page(struct page_table *page_table, uintptr_t vaddr, u
 		pml3[pml_indices.pml3_index] = pmm_alloc(1, 1) | (flags & PML3_FLAGS_MASK);
 	}
 
+	if(pml3[pml_indices.pml3_index] & VMM_FLAGS_PS) {
+		vmm_split_huge(&pml3[pml_indices.pml3_index]);
+	}
+
 	uint64_t *pml2 = (uint64_t*)((pml3[pml_indices.pml3_index] & ~(0xfff)) + HIGH_VMA);
 
 	if(flags & VMM_FLAGS_PS) {
 		pml2[pml_indices.pml2_index] = paddr | flags;
 		spinrelease_irqsave(&page_table->lock);
-		return NULL;
+		return &pml2[pml_indices.pml2_index];
 	}
 
+	vmm_unshare_locked(page_table, &pml2[pml_indices.pml2_index], vaddr);
+
 	if((pml2[pml_indices.pml2_index] & VMM_FLAGS_P) == 0) {
 		pml2[pml_indices.pml2_index] = pmm_alloc(1, 1) | (flags & PML2_FLAGS_MASK);
 	}
 
 	uint64_t *pml1 = (uint64_t*)((pml2[pml_indices.pml2_index] & ~(0xfff)) + HIGH_VMA);
 
+	if(pml1[pml_indices.pml1_index] & VMM_FLAGS_P) {
+		vmm_tlb_stale(page_table);
+	}
+
 	pml1[pml_indices.pml1_index] = paddr | flags;
 
 	spinrelease_irqsave(&page_table->lock);
@@ -240,12 +546,12 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 
 	spinlock_irqsave(&page_table->lock);
 
-	if((page_table->pml_high[pml_indices.pml4_index] & VMM_FLAGS_P) == 0) {
+	if((page_table->pml_high[pml_indices.pml5_index] & VMM_FLAGS_P) == 0) {
 		spinrelease_irqsave(&page_table->lock);
 		return 0;
 	}
 
-	uint64_t *pml4 = (uint64_t*)((page_table->pml_high[pml_indices.pml4_index] & ~(0xfff)) + HIGH_VMA);
+	uint64_t *pml4 = (uint64_t*)((page_table->pml_high[pml_indices.pml5_index] & ~(0xfff)) + HIGH_VMA);
 
 	if((pml4[pml_indices.pml4_index] & VMM_FLAGS_P) == 0) {
 		spinrelease_irqsave(&page_table->lock);
@@ -259,10 +565,19 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 		return 0;
 	}
 
+	if(pml3[pml_indices.pml3_index] & VMM_FLAGS_PS) {
+		pml3[pml_indices.pml3_index] &= ~(VMM_FLAGS_P);
+		vmm_tlb_stale(page_table);
+		invlpg(vaddr);
+		spinrelease_irqsave(&page_table->lock);
+		return VMM_HUGE_1G_SIZE;
+	}
+
 	uint64_t *pml2 = (uint64_t*)((pml3[pml_indices.pml3_index] & ~(0xfff)) + HIGH_VMA);
 
 	if((pml2[pml_indices.pml2_index] & 0xfff) & VMM_FLAGS_PS) {
 		pml2[pml_indices.pml2_index] &= ~(VMM_FLAGS_P);
+		vmm_tlb_stale(page_table);
 		invlpg(vaddr);
 		spinrelease_irqsave(&page_table->lock);
 		return 0x200000;
@@ -273,9 +588,12 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 		return 0;
 	}
 
+	vmm_unshare_locked(page_table, &pml2[pml_indices.pml2_index], vaddr);
+
 	uint64_t *pml1 = (uint64_t*)((pml2[pml_indices.pml2_index] & ~(0xfff)) + HIGH_VMA);
 
-	pml1[pml_indices.pml1_index] &= ~(VMM_FLAGS_P);
+	pml1[pml_indices.pml1_index] &= ~(VMM_FLAGS_P | VMM_SWAP_FLAG);
+	vmm_tlb_stale(page_table);
 	invlpg(vaddr);
 
 	spinrelease_irqsave(&page_table->lock);
@@ -283,278 +601,1990 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 	return 0x1000;
 }
 
-void vmm_map_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt, uint64_t flags) {
-	if(flags & VMM_FLAGS_PS) {
-		for(size_t i = 0; i < cnt; i++) {
-			page_table->map_page(page_table, vaddr, pmm_alloc(1, 0x200), flags);
-			vaddr += 0x200000;
-		}
-	} else {
-		for(size_t i = 0; i < cnt; i++) {
-			page_table->map_page(page_table, vaddr, pmm_alloc(1, 1), flags);
-			vaddr += 0x1000;
-		}
-	}
-}
-
-void vmm_unmap_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt) {
-	for(size_t i = 0; i < cnt; i++) {
-		size_t page_size = page_table->unmap_page(page_table, vaddr);
-		if(page_size == 0) {
-			return;
-		}
-		vaddr += page_size;
-	}
-}
+// walks down to the pml2 entry covering vaddr with the page table lock held, NULL when a level
+// above it maps a 1GiB page or is missing and create is 0. otherwise missing levels are
+// allocated with the create flags
 
-void vmm_init_page_table(struct page_table *page_table) {
-	asm volatile ("mov %0, %%cr3" :: "r"((uint64_t)page_table->pml_high - HIGH_VMA) : "memory");
-}
+static uint64_t *vmm_pml2_entry(struct page_table *page_table, uintptr_t vaddr, uint64_t create) {
+	struct pml_indices pml_indices = compute_table_indices(vaddr);
 
-void vmm_init() {
-	vmm_default_table(&kernel_mappings);
-	vmm_init_page_table(&kernel_mappings);
-}
+	uint64_t *table = page_table->pml_high;
+	uint64_t indices[] = { pml_indices.pml5_index, pml_indices.pml4_index, pml_indices.pml3_index };
+	size_t level = page_table->map_page == pml5_map_page ? 0 : 1;
 
-static volatile struct limine_kernel_address_request limine_kernel_address_request = {
-	.id = LIMINE_KERNEL_ADDRESS_REQUEST,
-	.revision = 0
-};
+	for(; level < 3; level++) {
+		if((table[indices[level]] & VMM_FLAGS_P) == 0 && create) {
+			table[indices[level]] = pmm_alloc(1, 1) | create;
+		}
 
-void vmm_default_table(struct page_table *page_table) {
-	struct cpuid_state cpuid_state = cpuid(7, 0);
+		uint64_t entry = table[indices[level]];
+		if((entry & VMM_FLAGS_P) == 0 || (entry & VMM_FLAGS_PS)) {
+			return NULL;
+		}
 
-	if(cpuid_state.rcx & (1 << 16)) {
-		page_table->map_page = pml5_map_page;
-		page_table->unmap_page = pml5_unmap_page;
-		page_table->lowest_level = pml5_lowest_level;
-	} else {
-		page_table->map_page = pml4_map_page;
-		page_table->unmap_page = pml4_unmap_page;
-		page_table->lowest_level = pml4_lowest_level;
+		table = (uint64_t*)((entry & ~(0xfff)) + HIGH_VMA);
 	}
 
-	page_table->pml_high = (uint64_t*)(pmm_alloc(1, 1) + HIGH_VMA);
-	page_table->pages = alloc(sizeof(struct hash_table));
-
-	uintptr_t kernel_vaddr = limine_kernel_address_request.response->virtual_base;
-	uintptr_t kernel_paddr = limine_kernel_address_request.response->physical_base;
+	return &table[pml_indices.pml2_index];
+}
 
-	for(size_t i = 0; i < 0x6400; i++) {
-		page_table->map_page(page_table, kernel_vaddr, kernel_paddr, VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_G | VMM_FLAGS_US);
-		kernel_vaddr += 0x1000;
-		kernel_paddr += 0x1000;
-	}
+// the pml1 table below vaddr with the page table lock held. create allocates whatever is missing
+// with those flags, a table shared since fork is unshared first since the caller is about to
+// write to it. NULL when there is no table or vaddr lies in a huge page
 
-	uint64_t phys = 0;
-	for(size_t i = 0; i < 0x800; i++) {
-		page_table->map_page(page_table, phys + HIGH_VMA, phys, VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_PS | VMM_FLAGS_G | VMM_FLAGS_US);
-		phys += 0x200000;
+static uint64_t *vmm_pml1_locked(struct page_table *page_table, uintptr_t vaddr, uint64_t create) {
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, vaddr, create);
+	if(pml2_entry == NULL) {
+		return NULL;
 	}
 
-	struct limine_memmap_entry **mmap = limine_memmap_request.response->entries;
-	uint64_t entry_count = limine_memmap_request.response->entry_count;
-
-	for(uint64_t i = 0; i < entry_count; i++) {
-		phys = (mmap[i]->base / 0x200000) * 0x200000;
-		for(size_t j = 0; j < DIV_ROUNDUP(mmap[i]->length, 0x200000); j++) {
-			page_table->map_page(page_table, phys + HIGH_VMA, phys, VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_PS | VMM_FLAGS_G | VMM_FLAGS_US);
-			phys += 0x200000;
+	if((*pml2_entry & VMM_FLAGS_P) == 0) {
+		if(create == 0) {
+			return NULL;
 		}
-	}
 
-	page_table->mmap_bump_base = MMAP_MAP_MIN_ADDR;
-}
+		*pml2_entry = pmm_alloc(1, 1) | create;
+	}
 
-struct mmap_region *vmm_copy_region_tree(struct mmap_region *root) {
-	if(root == NULL) {
+	if(*pml2_entry & VMM_FLAGS_PS) {
 		return NULL;
 	}
 
-	struct mmap_region *region = alloc(sizeof(struct mmap_region));
-	*region = *root;
-
-	region->left = vmm_copy_region_tree(root->left);
-	region->right = vmm_copy_region_tree(root->right);
+	vmm_unshare_locked(page_table, pml2_entry, vaddr);
 
-	return region;
+	return (uint64_t*)((*pml2_entry & ~(0xfff)) + HIGH_VMA);
 }
 
-struct page_table *vmm_fork_page_table(struct page_table *page_table) {
-	struct page_table *new_table = alloc(sizeof(struct page_table));
+// the range primitives below take the page table lock once and walk down from the top once per
+// 2MiB, where map_page and friends do both for every single page. huge pages straddling either
+// end of a range have to be split by the caller
 
-	vmm_default_table(new_table);
+// returns the pte of vaddr, the ptes of a range inside one 2MiB block follow it in order
 
-	for(size_t i = 0; i < page_table->pages->capacity; i++) {
-		struct page *page = page_table->pages->data[i];
+uint64_t *vmm_map_pages(struct page_table *page_table, uintptr_t vaddr, const uint64_t *frames, size_t cnt, uint64_t flags) {
+	uint64_t create = VMM_FLAGS_P | VMM_FLAGS_RW | (flags & VMM_FLAGS_US);
+	uint64_t *first = NULL;
+	bool stale = false;
 
-		if(page) {
-			if(!(*page->pml_entry & VMM_SHARE_FLAG)) {
-				*page->pml_entry &= ~(VMM_FLAGS_RW);
-				*page->pml_entry |= VMM_COW_FLAG;
+	spinlock_irqsave(&page_table->lock);
 
-				page->flags = (page->flags & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
-			}
+	for(size_t i = 0; i < cnt;) {
+		uintptr_t addr = vaddr + i * PAGE_SIZE;
 
-			(*page->reference)++;
+		uint64_t *pml1 = vmm_pml1_locked(page_table, addr, create);
+		if(pml1 == NULL) {
+			panic("vmm: range map over a huge page at %x", addr);
+		}
 
-			invlpg(page->vaddr);
+		size_t index = (addr >> 12) & 0x1ff;
+		size_t run = 512 - index < cnt - i ? 512 - index : cnt - i;
 
-			struct page *new_page = alloc(sizeof(struct page));
-			*new_page = *page;
+		for(size_t j = 0; j < run; j++) {
+			if(pml1[index + j] & VMM_FLAGS_P) {
+				stale = true;
+			}
 
-			new_page->pml_entry = new_table->map_page(new_table, page->vaddr, page->frame->addr, page->flags);
+			pml1[index + j] = frames[i + j] | flags;
+		}
 
-			hash_table_push(new_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
+		if(first == NULL) {
+			first = &pml1[index];
 		}
+
+		i += run;
 	}
 
-	uint64_t cr3;
-	asm volatile ("mov %%cr3, %0" : "=a"(cr3));
-	asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+	if(stale) {
+		vmm_tlb_stale(page_table);
+	}
 
-	new_table->mmap_region_root = vmm_copy_region_tree(page_table->mmap_region_root);
+	spinrelease_irqsave(&page_table->lock);
 
-	return new_table;
+	return first;
 }
 
-int vmm_file_map(struct page_table *page_table, uintptr_t address) {
-	struct mmap_region *root = page_table->mmap_region_root;
-	if(root == NULL) {
-		return -1;
-	}
-
-	uint64_t faulting_page = address & ~(0xfff);
-	uint64_t *lowest_level = page_table->lowest_level(page_table, faulting_page);
+// a shared table that the whole range covers is only let go of, copying it first just to clear
+// it would be a waste. returns false when the table turns out to be ours alone
 
-	while(root) {
-		if(root->base <= address && (root->base + root->limit) >= address) {
-			struct page *page = hash_table_search(page_table->pages, &faulting_page, sizeof(faulting_page));
-			if(page == NULL) {
-				return -1;
-			}
+static bool vmm_release_block(struct vmm_page_block *block) {
+	spinlock_irqsave(&block->lock);
 
-			invlpg(address);
+	bool shared = block->refcnt > 1;
+	if(shared) {
+		block->refcnt--;
+	}
 
-			int ret = page->file->ops->read(page->file, (void*)(page->frame->addr + HIGH_VMA), PAGE_SIZE, page->offset) == -1 ? 0 : 1;
-			if(ret) {
-				*lowest_level = *lowest_level | VMM_FLAGS_P;
-			}
+	spinrelease_irqsave(&block->lock);
 
-			return 0;
-		}
+	return shared;
+}
 
-		if(root->base > address) {
-			root = root->left;
-		} else {
-			root = root->right;
-		}
+static bool vmm_release_table(struct page_table *page_table, uintptr_t vaddr) {
+	struct vmm_page_block *block = vmm_page_block(page_table, vaddr);
+	if(block == NULL || !vmm_release_block(block)) {
+		return false;
 	}
 
-	return -1;
+	radix_tree_delete(&page_table->pages, vaddr >> 21);
+
+	return true;
 }
 
-int vmm_anon_map(struct page_table *page_table, uintptr_t address) {
-	struct mmap_region *root = page_table->mmap_region_root;
-	if(root == NULL) {
-		return -1;
+// old, when not NULL, receives what every pte held before, a huge page shows up at the index of
+// its base. every address that was mapped lands in batch, the frames stay the caller's business
+
+void vmm_unmap_pages(struct page_table *page_table, uintptr_t vaddr, size_t cnt, uint64_t *old, struct tlb_batch *batch) {
+	uintptr_t end = vaddr + cnt * PAGE_SIZE;
+
+	if(old) {
+		memset64(old, 0, cnt);
 	}
 
-	while(root) {
-		if(root->base <= address && (root->base + root->limit) >= address) {
-			uint64_t flags = VMM_FLAGS_P | VMM_FLAGS_NX;
+	spinlock_irqsave(&page_table->lock);
 
-			if(root->prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
-			if(root->prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
-			if(root->prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
-			if(root->prot & MMAP_PROT_NONE) flags &= ~(VMM_FLAGS_P);
+	for(uintptr_t addr = vaddr; addr < end;) {
+		uintptr_t next = (addr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE;
+		if(next > end) {
+			next = end;
+		}
 
-			size_t misalignment = address & (PAGE_SIZE - 1);
+		uint64_t *pml2_entry = vmm_pml2_entry(page_table, addr, 0);
 
-			struct frame *frame = alloc(sizeof(struct frame));
-			frame->addr = pmm_alloc(1, 1);
+		if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_P) == 0) {
+			addr = next;
+			continue;
+		}
 
-			uint64_t vaddr = address - misalignment;
+		bool whole = next - addr == VMM_HUGE_PAGE_SIZE;
 
-			invlpg(address);
+		if(*pml2_entry & VMM_FLAGS_PS) {
+			if(whole) {
+				if(old) {
+					old[(addr - vaddr) / PAGE_SIZE] = *pml2_entry;
+				}
 
-			struct page *new_page = alloc(sizeof(struct page));
-			*new_page = (struct page) {
-				.vaddr = vaddr,
-				.frame = frame,
-				.size = PAGE_SIZE,
-				.flags = flags,
-				.pml_entry = page_table->map_page(page_table, vaddr, frame->addr, flags),
-				.reference = alloc(sizeof(int))
-			};
+				*pml2_entry &= ~(VMM_FLAGS_P);
+				tlb_batch_add(batch, addr);
+			}
 
-			*(new_page->reference) = 1;
+			addr = next;
+			continue;
+		}
 
-			hash_table_push(page_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
+		uint64_t *pml1 = (uint64_t*)((*pml2_entry & ~(0xfff)) + HIGH_VMA);
 
-			return 0;
+		if(old) {
+			memcpy64(old + (addr - vaddr) / PAGE_SIZE, pml1 + ((addr >> 12) & 0x1ff), (next - addr) / PAGE_SIZE);
 		}
 
-		if(root->base > address) {
-			root = root->left;
-		} else {
-			root = root->right;
+		if(whole && (*pml2_entry & VMM_PT_COW_FLAG) && vmm_release_table(page_table, addr)) {
+			*pml2_entry = 0;
+			tlb_batch_add_range(batch, addr, 512);
+			addr = next;
+			continue;
 		}
-	}
 
-	return -1;
-}
+		pml1 = vmm_pml1_locked(page_table, addr, 0);
 
-int vmm_pf_handler(struct registers *regs) {
-	struct task *task = CURRENT_TASK;
-	if(task == NULL) {
-		return -1;
+		for(; addr < next; addr += PAGE_SIZE) {
+			uint64_t *entry = &pml1[(addr >> 12) & 0x1ff];
+
+			if(*entry & VMM_FLAGS_P) {
+				tlb_batch_add(batch, addr);
+			}
+
+			*entry &= ~(VMM_FLAGS_P | VMM_SWAP_FLAG);
+		}
+	}
+
+	vmm_tlb_stale(page_table);
+
+	spinrelease_irqsave(&page_table->lock);
+}
+
+static uint64_t vmm_protect_entry(uint64_t entry, uint64_t set, uint64_t clear) {
+	uint64_t ret = (entry & ~clear) | set;
+
+	if(entry & VMM_COW_FLAG) { // stays read only until the write fault that breaks it
+		ret &= ~(VMM_FLAGS_RW);
+	}
+
+	return ret;
+}
+
+// set and clear apply to present and swapped out ptes alike, cow pages never become writable here
+
+void vmm_protect_pages(struct page_table *page_table, uintptr_t vaddr, size_t cnt, uint64_t set, uint64_t clear, struct tlb_batch *batch) {
+	uintptr_t end = vaddr + cnt * PAGE_SIZE;
+
+	spinlock_irqsave(&page_table->lock);
+
+	for(uintptr_t addr = vaddr; addr < end;) {
+		uintptr_t next = (addr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE;
+		if(next > end) {
+			next = end;
+		}
+
+		uint64_t *pml2_entry = vmm_pml2_entry(page_table, addr, 0);
+
+		if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_P) == 0) {
+			addr = next;
+			continue;
+		}
+
+		if(*pml2_entry & VMM_FLAGS_PS) {
+			if(next - addr == VMM_HUGE_PAGE_SIZE) {
+				*pml2_entry = vmm_protect_entry(*pml2_entry, set, clear);
+				tlb_batch_add(batch, addr);
+			}
+
+			addr = next;
+			continue;
+		}
+
+		uint64_t *pml1 = vmm_pml1_locked(page_table, addr, 0);
+
+		for(; addr < next; addr += PAGE_SIZE) {
+			uint64_t *entry = &pml1[(addr >> 12) & 0x1ff];
+
+			if((*entry & (VMM_FLAGS_P | VMM_SWAP_FLAG)) == 0) {
+				continue;
+			}
+
+			uint64_t new_entry = vmm_protect_entry(*entry, set, clear);
+
+			if(new_entry != *entry) {
+				if(*entry & VMM_FLAGS_P) {
+					tlb_batch_add(batch, addr);
+				}
+
+				*entry = new_entry;
+			}
+		}
+	}
+
+	vmm_tlb_stale(page_table);
+
+	spinrelease_irqsave(&page_table->lock);
+}
+
+void vmm_map_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt, uint64_t flags) {
+	if(flags & VMM_FLAGS_PS) {
+		for(size_t i = 0; i < cnt; i++) {
+			page_table->map_page(page_table, vaddr, pmm_alloc(0x200, 0x200), flags);
+			vaddr += 0x200000;
+		}
+
+		return;
+	}
+
+	uint64_t frames[VMM_MAP_BATCH];
+
+	while(cnt) {
+		size_t index = (vaddr >> 12) & 0x1ff;
+		size_t batch = VMM_MAP_BATCH - index < cnt ? VMM_MAP_BATCH - index : cnt;
+
+		if(pmm_alloc_batch(frames, batch, true) != batch) {
+			panic("vmm: out of memory");
+		}
+
+		vmm_map_pages(page_table, vaddr, frames, batch, flags);
+
+		vaddr += batch * PAGE_SIZE;
+		cnt -= batch;
+	}
+}
+
+void vmm_unmap_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt) {
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table, TLB_REASON_UNMAP);
+
+	vmm_unmap_pages(page_table, vaddr, cnt, NULL, &batch);
+
+	tlb_batch_flush(&batch);
+}
+
+static uint64_t vmm_table_id;
+
+// every cpu keeps its own small set of pcids. switching back to a table that still owns one keeps
+// its tlb entries, and switching to the table already in cr3 does not touch cr3 at all
+
+void vmm_init_page_table(struct page_table *page_table) {
+	uint64_t cr3 = (uint64_t)page_table->pml_high - HIGH_VMA;
+	struct cpu_local *cpu_local = CORE_LOCAL;
+
+	if(cpu_local) { // published before the generation is sampled, pairs with tlb_batch_flush
+		__atomic_store_n(&cpu_local->active_page_table, page_table, __ATOMIC_SEQ_CST);
+	}
+
+	if(!cpu_pcid_enabled || cpu_local == NULL) {
+		asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+		return;
+	}
+
+	bool interrupts = get_interrupt_state();
+	asm volatile ("cli");
+
+	struct vmm_pcid_cache *cache = &cpu_local->pcid_cache;
+	uint64_t tlb_generation = __atomic_load_n(&page_table->tlb_generation, __ATOMIC_ACQUIRE);
+
+	if(cache->active) {
+		struct vmm_pcid_slot *slot = &cache->slots[cache->active - 1];
+
+		if(slot->page_table == page_table && slot->id == page_table->id) {
+			cache->skips++;
+			goto finish;
+		}
+	}
+
+	size_t index = 0;
+	for(; index < VMM_PCID_SLOTS; index++) {
+		struct vmm_pcid_slot *slot = &cache->slots[index];
+		if(slot->page_table == page_table && slot->id == page_table->id) {
+			break;
+		}
+	}
+
+	if(index == VMM_PCID_SLOTS) {
+		index = cache->next++ % VMM_PCID_SLOTS;
+
+		cache->slots[index].page_table = page_table;
+		cache->slots[index].id = page_table->id;
+		cache->misses++;
+	} else if(cache->slots[index].tlb_generation == tlb_generation) {
+		cr3 |= VMM_CR3_NOFLUSH;
+		cache->hits++;
+	} else {
+		cache->flushes++;
+	}
+
+	cache->slots[index].tlb_generation = tlb_generation;
+	cache->active = index + 1;
+
+	cr3 |= index + 1;
+	asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+finish:
+	if(interrupts) {
+		asm volatile ("sti");
+	}
+}
+
+void vmm_print_tlb_stats() {
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct cpu_local *cpu_local = cpu_local_list.data[i];
+		struct vmm_pcid_cache *cache = &cpu_local->pcid_cache;
+
+		print("vmm: cpu %d: pcid hits %d misses %d flushes %d skipped switches %d\n",
+			cpu_local->apic_id, cache->hits, cache->misses, cache->flushes, cache->skips);
+	}
+}
+
+static volatile struct limine_kernel_address_request limine_kernel_address_request = {
+	.id = LIMINE_KERNEL_ADDRESS_REQUEST,
+	.revision = 0
+};
+
+static void vmm_table_ops(struct page_table *page_table) {
+	struct cpuid_state cpuid_state = cpuid(7, 0);
+
+	if(cpuid_state.rcx & (1 << 16)) {
+		page_table->map_page = pml5_map_page;
+		page_table->unmap_page = pml5_unmap_page;
+		page_table->lowest_level = pml5_lowest_level;
+	} else {
+		page_table->map_page = pml4_map_page;
+		page_table->unmap_page = pml4_unmap_page;
+		page_table->lowest_level = pml4_lowest_level;
+	}
+}
+
+static uint64_t *vmm_pml3_entry(struct page_table *page_table, uintptr_t vaddr) {
+	struct pml_indices pml_indices = compute_table_indices(vaddr);
+	uint64_t *table = page_table->pml_high;
+
+	if(page_table->map_page == pml5_map_page) {
+		if((table[pml_indices.pml5_index] & VMM_FLAGS_P) == 0) {
+			table[pml_indices.pml5_index] = pmm_alloc(1, 1) | VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_US;
+		}
+
+		table = (uint64_t*)((table[pml_indices.pml5_index] & ~(0xfff)) + HIGH_VMA);
+	}
+
+	if((table[pml_indices.pml4_index] & VMM_FLAGS_P) == 0) {
+		table[pml_indices.pml4_index] = pmm_alloc(1, 1) | VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_US;
+	}
+
+	uint64_t *pml3 = (uint64_t*)((table[pml_indices.pml4_index] & ~(0xfff)) + HIGH_VMA);
+
+	return &pml3[pml_indices.pml3_index];
+}
+
+static void vmm_map_hhdm(struct page_table *page_table, uint64_t base, uint64_t limit, bool huge_1g) {
+	uint64_t flags = VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_PS | VMM_FLAGS_G | VMM_FLAGS_US;
+
+	if(huge_1g) {
+		for(uint64_t phys = (base / VMM_HUGE_1G_SIZE) * VMM_HUGE_1G_SIZE; phys < limit; phys += VMM_HUGE_1G_SIZE) {
+			*vmm_pml3_entry(page_table, phys + HIGH_VMA) = phys | flags;
+		}
+	} else {
+		for(uint64_t phys = (base / 0x200000) * 0x200000; phys < limit; phys += 0x200000) {
+			page_table->map_page(page_table, phys + HIGH_VMA, phys, flags);
+		}
+	}
+}
+
+// kernel_mappings owns the kernel half outright. every upper level entry is populated up front so
+// that later kernel mappings (vmalloc, apic, ...) land in tables all address spaces share
+
+void vmm_init() {
+	struct page_table *page_table = &kernel_mappings;
+
+	vmm_table_ops(page_table);
+
+	page_table->pml_high = (uint64_t*)(pmm_alloc(1, 1) + HIGH_VMA);
+	page_table->id = __atomic_add_fetch(&vmm_table_id, 1, __ATOMIC_RELAXED);
+
+	vmm_zero_frame = pmm_alloc(1, 1);
+
+	for(size_t i = 256; i < 512; i++) {
+		page_table->pml_high[i] = pmm_alloc(1, 1) | VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_US;
+	}
+
+	uintptr_t kernel_vaddr = limine_kernel_address_request.response->virtual_base;
+	uintptr_t kernel_paddr = limine_kernel_address_request.response->physical_base;
+
+	for(size_t i = 0; i < 0x6400; i++) {
+		page_table->map_page(page_table, kernel_vaddr, kernel_paddr, VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_G | VMM_FLAGS_US);
+		kernel_vaddr += 0x1000;
+		kernel_paddr += 0x1000;
+	}
+
+	bool huge_1g = cpuid(0x80000001, 0).rdx & (1 << 26);
+
+	vmm_map_hhdm(page_table, 0, 0x100000000, huge_1g);
+
+	struct limine_memmap_entry **mmap = limine_memmap_request.response->entries;
+	uint64_t entry_count = limine_memmap_request.response->entry_count;
+
+	for(uint64_t i = 0; i < entry_count; i++) {
+		vmm_map_hhdm(page_table, mmap[i]->base, mmap[i]->base + mmap[i]->length, huge_1g);
+	}
+
+	page_table->mmap_min_addr = MMAP_MAP_MIN_ADDR;
+
+	print("vmm: direct map built with %s pages\n", huge_1g ? "1GiB" : "2MiB");
+
+	vmm_init_page_table(page_table);
+}
+
+struct vmm_teardown_stats {
+	size_t live; // address spaces made by vmm_default_table and not torn down yet
+	size_t destroyed;
+	size_t table_pages;
+	size_t records;
+	size_t frames;
+};
+
+static struct vmm_teardown_stats vmm_teardown_stats;
+
+// a new address space only needs its own top level table, the kernel half is borrowed from
+// kernel_mappings entry by entry. the caller holds the one reference it starts out with
+
+void vmm_default_table(struct page_table *page_table) {
+	vmm_table_ops(page_table);
+
+	page_table->pml_high = (uint64_t*)(pmm_alloc(1, 1) + HIGH_VMA);
+	page_table->pages = (struct radix_tree) { 0 };
+	page_table->id = __atomic_add_fetch(&vmm_table_id, 1, __ATOMIC_RELAXED);
+	page_table->refcnt = 1;
+
+	__atomic_add_fetch(&vmm_teardown_stats.live, 1, __ATOMIC_RELAXED);
+
+	for(size_t i = 256; i < 512; i++) {
+		page_table->pml_high[i] = kernel_mappings.pml_high[i];
+	}
+
+	page_table->mmap_min_addr = MMAP_MAP_MIN_ADDR;
+
+	vmm_list_table(page_table);
+}
+
+struct mmap_region *vmm_copy_region_tree(struct mmap_region *root) {
+	if(root == NULL) {
+		return NULL;
+	}
+
+	struct mmap_region *region = alloc(sizeof(struct mmap_region));
+	*region = *root;
+
+	if(region->file) {
+		file_get(region->file);
+	}
+
+	region->left = vmm_copy_region_tree(root->left);
+	region->right = vmm_copy_region_tree(root->right);
+
+	return region;
+}
+
+static void vmm_free_region_tree(struct mmap_region *root) {
+	if(root == NULL) {
+		return;
+	}
+
+	vmm_free_region_tree(root->left);
+	vmm_free_region_tree(root->right);
+
+	if(root->file) {
+		file_put(root->file);
+	}
+
+	free(root);
+}
+
+struct vmm_fork {
+	struct page_table *parent;
+	struct page_table *child;
+	struct tlb_batch batch;
+
+	size_t shared; // pml1 tables
+	size_t records;
+};
+
+// copies the upper levels of the user half and shares everything from pml1 down. the page records
+// go along with their tables, only those of huge pages are copied since every side has its own
+// pml2 entry for them
+
+static void vmm_fork_level(struct vmm_fork *fork, uint64_t *src, uint64_t *dst, int level, size_t cnt, uintptr_t vaddr) {
+	size_t shift = 12 + 9 * (level - 1);
+
+	for(size_t i = 0; i < cnt; i++) {
+		// a huge page that mprotect took away keeps its pml2 entry without the present bit
+		if((src[i] & VMM_FLAGS_P) == 0 && (level != 2 || (src[i] & VMM_FLAGS_PS) == 0)) {
+			continue;
+		}
+
+		uintptr_t entry_vaddr = vaddr + (i << shift);
+
+		if(level == 2) {
+			if(src[i] & VMM_FLAGS_PS) { // huge pages are cow'd whole, a write splits them
+				if((src[i] & VMM_SHARE_FLAG) == 0) {
+					src[i] = (src[i] & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+				}
+
+				dst[i] = src[i];
+				tlb_batch_add(&fork->batch, entry_vaddr);
+
+				struct page *page = vmm_page_search(fork->parent, entry_vaddr);
+				if(page) {
+					if((page->flags & VMM_SHARE_FLAG) == 0) {
+						page->flags = (page->flags & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+					}
+
+					struct page *new_page = slab_cache_alloc_nozero(page_cache);
+
+					*new_page = *page;
+					new_page->pml_entry = &dst[i];
+
+					(*page->reference)++;
+
+					vmm_page_insert(fork->child, new_page);
+					fork->records++;
+				}
+
+				continue;
+			}
+
+			src[i] = (src[i] & ~(VMM_FLAGS_RW)) | VMM_PT_COW_FLAG;
+			dst[i] = src[i];
+
+			fork->records += vmm_share_block(fork->parent, fork->child, entry_vaddr);
+			fork->shared++;
+
+			tlb_batch_add_range(&fork->batch, entry_vaddr, 512);
+
+			continue;
+		}
+
+		uint64_t table = pmm_alloc(1, 1);
+		dst[i] = table | (src[i] & 0xfff);
+
+		vmm_fork_level(fork, (uint64_t*)((src[i] & ~(0xfff)) + HIGH_VMA), (uint64_t*)(table + HIGH_VMA),
+			level - 1, 512, entry_vaddr);
+	}
+}
+
+#define VMM_FORK_BUCKETS 24
+
+struct vmm_fork_bucket {
+	size_t forks;
+	uint64_t cycles;
+};
+
+static struct vmm_fork_bucket vmm_fork_buckets[VMM_FORK_BUCKETS]; // by log2 of the parent's resident pages
+static size_t vmm_fork_cnt;
+static size_t vmm_fork_shared_tables;
+
+struct page_table *vmm_fork_page_table(struct page_table *page_table) {
+	uint64_t start = rdtsc();
+
+	struct page_table *new_table = alloc(sizeof(struct page_table));
+
+	vmm_default_table(new_table);
+
+	struct vmm_fork fork = {
+		.parent = page_table,
+		.child = new_table
+	};
+
+	tlb_batch_init(&fork.batch, page_table, TLB_REASON_FORK);
+
+	spinlock_irqsave(&page_table->lock);
+
+	int top_level = page_table->map_page == pml5_map_page ? 5 : 4;
+	vmm_fork_level(&fork, page_table->pml_high, new_table->pml_high, top_level, 256, 0);
+
+	vmm_tlb_stale(page_table);
+
+	spinrelease_irqsave(&page_table->lock);
+
+	uint64_t cr3;
+	asm volatile ("mov %%cr3, %0" : "=a"(cr3));
+	asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+
+	tlb_batch_flush(&fork.batch); // other threads of the parent must see the write protection too
+
+	new_table->mmap_region_root = vmm_copy_region_tree(page_table->mmap_region_root);
+
+	uint64_t cycles = rdtsc() - start;
+	size_t rss = fork.records;
+
+	size_t bucket = 0;
+	while((rss >> (bucket + 1)) && bucket < VMM_FORK_BUCKETS - 1) {
+		bucket++;
+	}
+
+	__atomic_add_fetch(&vmm_fork_buckets[bucket].forks, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vmm_fork_buckets[bucket].cycles, cycles, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vmm_fork_cnt, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vmm_fork_shared_tables, fork.shared, __ATOMIC_RELAXED);
+
+	return new_table;
+}
+
+void vmm_print_fork_stats() {
+	print("vmm: forks %d shared tables %d unshared by copy %d unshared in place %d\n",
+		vmm_fork_cnt, vmm_fork_shared_tables, vmm_unshared_copies, vmm_unshared_reuses);
+
+	for(size_t i = 0; i < VMM_FORK_BUCKETS; i++) {
+		struct vmm_fork_bucket *bucket = &vmm_fork_buckets[i];
+		if(bucket->forks == 0) {
+			continue;
+		}
+
+		print("vmm: fork rss < %d pages: forks %d average cycles %d\n",
+			1ull << (i + 1), bucket->forks, bucket->cycles / bucket->forks);
+	}
+}
+
+// settles the record of a mapping that goes away for good, entry is what its pte held. records
+// fork made of the same page share the frame struct and the reference count, the last one to
+// let go frees them. returns the number of frames handed back to the pmm
+
+size_t vmm_page_release(struct page *page, uint64_t entry) {
+	bool swapped = page->flags & VMM_SWAP_FLAG;
+	bool cached = page->cached != NULL;
+	size_t freed = 0;
+
+	if(swapped && (entry & VMM_SWAP_FLAG)) {
+		swap_free((entry & VMM_PTE_ADDR_MASK) >> 12);
+	}
+
+	if(cached) { // the frame struct lives in the page cache
+		pcache_unmap(page, entry);
+	}
+
+	if(--(*page->reference) == 0) {
+		free(page->reference);
+
+		if(!cached) {
+			if(!swapped && page->frame->addr != vmm_zero_frame) {
+				pmm_free(page->frame->addr, page->size / PAGE_SIZE);
+				freed = page->size / PAGE_SIZE;
+			}
+
+			if(page->frame->locks.length == 0) { // futex waiters still look at it
+				slab_cache_free(frame_cache, page->frame);
+			}
+		}
+	}
+
+	slab_cache_free(page_cache, page);
+
+	return freed;
+}
+
+// frees the tables below cnt entries of a user half table bottom up, returns the number of
+// tables freed
+
+static size_t vmm_free_level(uint64_t *table, int level, size_t cnt) {
+	size_t freed = 0;
+
+	for(size_t i = 0; i < cnt; i++) {
+		if((table[i] & VMM_FLAGS_P) == 0 || (table[i] & VMM_FLAGS_PS)) {
+			continue;
+		}
+
+		uint64_t next = table[i] & VMM_PTE_ADDR_MASK;
+
+		if(level > 2) {
+			freed += vmm_free_level((uint64_t*)(next + HIGH_VMA), level - 1, 512);
+		}
+
+		pmm_free(next, 1);
+		freed++;
+	}
+
+	return freed;
+}
+
+// the last reference is gone. no cpu may have the address space loaded anymore, the page records
+// are settled first while their ptes can still be read. a table fork still shares with another
+// address space is only let go of along with its records
+
+static void vmm_destroy_page_table(struct page_table *page_table) {
+	vmm_unlist_table(page_table);
+
+	size_t records = 0;
+	size_t frames = 0;
+
+	struct vmm_page_block *block;
+	for(uint64_t index = 0; (block = radix_tree_next(&page_table->pages, &index)); index++) {
+		radix_tree_delete(&page_table->pages, index);
+
+		if(vmm_release_block(block)) {
+			*vmm_pml2_entry(page_table, index << 21, 0) = 0;
+			continue;
+		}
+
+		for(size_t i = 0; i < 512; i++) {
+			struct page *page = block->pages[i];
+			if(page == NULL) {
+				continue;
+			}
+
+			uint64_t *entry = page_table->lowest_level(page_table, page->vaddr);
+
+			frames += vmm_page_release(page, entry ? *entry : 0);
+			records++;
+		}
+
+		free(block);
+	}
+
+	int top_level = page_table->map_page == pml5_map_page ? 5 : 4;
+	size_t tables = vmm_free_level(page_table->pml_high, top_level, 256);
+
+	vmm_free_region_tree(page_table->mmap_region_root);
+
+	pmm_free((uintptr_t)page_table->pml_high - HIGH_VMA, 1);
+	free(page_table);
+
+	struct vmm_teardown_stats *stats = &vmm_teardown_stats;
+
+	__atomic_sub_fetch(&stats->live, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->destroyed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->table_pages, tables + 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->records, records, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->frames, frames, __ATOMIC_RELAXED);
+}
+
+void vmm_get_page_table(struct page_table *page_table) {
+	__atomic_add_fetch(&page_table->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+// threads killed along with their group may still be running on other cpus when the last
+// reference goes. the address space waits here until each cpu that had it loaded has switched
+// to another task, entries in context_switches are -1 for cpus that did not have it loaded
+
+struct vmm_dead_table {
+	struct page_table *page_table;
+	uint64_t *context_switches; // by index in cpu_local_list
+};
+
+static VECTOR(struct vmm_dead_table) vmm_dead_tables;
+static struct spinlock vmm_dead_lock;
+
+static bool vmm_table_loaded(struct vmm_dead_table *dead) {
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		if(dead->context_switches[i] != (uint64_t)-1 &&
+			__atomic_load_n(&cpu_local_list.data[i]->context_switches, __ATOMIC_ACQUIRE) == dead->context_switches[i]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void vmm_destroy_dead_tables() {
+	for(;;) {
+		struct page_table *page_table = NULL;
+
+		spinlock_irqsave(&vmm_dead_lock);
+
+		for(size_t i = 0; i < vmm_dead_tables.length; i++) {
+			struct vmm_dead_table *dead = &vmm_dead_tables.data[i];
+
+			if(!vmm_table_loaded(dead)) {
+				page_table = dead->page_table;
+				free(dead->context_switches);
+				VECTOR_REMOVE_BY_INDEX(vmm_dead_tables, i);
+				break;
+			}
+		}
+
+		spinrelease_irqsave(&vmm_dead_lock);
+
+		if(page_table == NULL) {
+			return;
+		}
+
+		vmm_destroy_page_table(page_table);
+	}
+}
+
+// the caller must have switched away from the address space already
+
+void vmm_put_page_table(struct page_table *page_table) {
+	vmm_destroy_dead_tables();
+
+	if(__atomic_sub_fetch(&page_table->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	uint64_t *context_switches = alloc(cpu_local_list.length * sizeof(uint64_t));
+	bool loaded = false;
+
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct cpu_local *cpu_local = cpu_local_list.data[i];
+
+		context_switches[i] = -1;
+
+		if(__atomic_load_n(&cpu_local->active_page_table, __ATOMIC_SEQ_CST) == page_table) {
+			context_switches[i] = __atomic_load_n(&cpu_local->context_switches, __ATOMIC_ACQUIRE);
+			loaded = true;
+		}
+	}
+
+	if(!loaded) {
+		free(context_switches);
+		vmm_destroy_page_table(page_table);
+		return;
+	}
+
+	spinlock_irqsave(&vmm_dead_lock);
+
+	VECTOR_PUSH(vmm_dead_tables, ((struct vmm_dead_table) {
+		.page_table = page_table,
+		.context_switches = context_switches
+	}));
+
+	spinrelease_irqsave(&vmm_dead_lock);
+}
+
+// live should come back to where it was once a fork and exit loop is over
+
+void vmm_print_teardown_stats() {
+	struct vmm_teardown_stats *stats = &vmm_teardown_stats;
+
+	print("vmm: address spaces live %d torn down %d waiting %d table pages freed %d records freed %d frames freed %d\n",
+		stats->live, stats->destroyed, vmm_dead_tables.length, stats->table_pages, stats->records, stats->frames);
+}
+
+// anonymous private regions are faulted in 2MiB at a time wherever a whole aligned huge page fits
+// inside the region and no 4KiB page has been placed in that range yet
+
+static size_t vmm_thp_faults;
+static size_t vmm_thp_fallbacks;
+static size_t vmm_thp_splits;
+static size_t vmm_thp_split_copies; // splits of a huge page fork still shared
+
+// rewrites a huge page as 512 ordinary pages, used before anything has to treat part of it
+// differently (partial munmap, cow). the pieces take over the frames of a huge page this side
+// holds alone. one that fork still shares is copied instead, the pieces could not share a count
+// with the huge record the other address space keeps
+
+void vmm_split_huge_page(struct page_table *page_table, uintptr_t vaddr) {
+	struct page *huge = vmm_page_search(page_table, vaddr);
+	if(huge == NULL || huge->size != VMM_HUGE_PAGE_SIZE) {
+		return;
+	}
+
+	uint64_t frames[VMM_HUGE_PAGE_SIZE / PAGE_SIZE];
+
+	if(*huge->reference > 1) {
+		vmm_alloc_frames(frames, VMM_HUGE_PAGE_SIZE / PAGE_SIZE, false);
+
+		for(size_t i = 0; i < 512; i++) {
+			memcpy64((uint64_t*)(frames[i] + HIGH_VMA), (uint64_t*)(huge->frame->addr + i * PAGE_SIZE + HIGH_VMA), PAGE_SIZE / 8);
+		}
+
+		__atomic_add_fetch(&vmm_thp_split_copies, 1, __ATOMIC_RELAXED);
+	} else {
+		for(size_t i = 0; i < 512; i++) {
+			frames[i] = huge->frame->addr + i * PAGE_SIZE;
+		}
+	}
+
+	uint64_t table = pmm_alloc_nozero(1, 1);
+	uint64_t *pml1 = (uint64_t*)(table + HIGH_VMA);
+
+	spinlock_irqsave(&page_table->lock);
+
+	uint64_t flags = *huge->pml_entry & (0xfff | VMM_FLAGS_NX) & ~(VMM_FLAGS_PS);
+
+	for(size_t i = 0; i < 512; i++) {
+		pml1[i] = frames[i] | flags;
+	}
+
+	*huge->pml_entry = table | (flags & PML2_FLAGS_MASK & ~(VMM_COW_FLAG | VMM_SHARE_FLAG)) | VMM_FLAGS_P | VMM_FLAGS_RW;
+
+	vmm_tlb_stale(page_table);
+	invlpg(huge->vaddr);
+
+	spinrelease_irqsave(&page_table->lock);
+
+	tlb_shootdown(page_table, huge->vaddr, TLB_REASON_SPLIT);
+
+	vmm_page_delete(page_table, huge->vaddr);
+
+	// every piece is this side's alone now, cow ones get made writable in place by their first
+	// write fault
+	for(size_t i = 0; i < 512; i++) {
+		struct frame *frame = slab_cache_alloc(frame_cache);
+		frame->addr = frames[i];
+
+		struct page *page = slab_cache_alloc_nozero(page_cache);
+		*page = (struct page) {
+			.vaddr = huge->vaddr + i * PAGE_SIZE,
+			.frame = frame,
+			.size = PAGE_SIZE,
+			.flags = flags,
+			.pml_entry = &pml1[i],
+			.reference = alloc(sizeof(int))
+		};
+
+		*page->reference = 1;
+
+		vmm_page_insert(page_table, page);
+	}
+
+	if(--(*huge->reference) == 0) {
+		free(huge->reference);
+
+		if(huge->frame->locks.length == 0) {
+			slab_cache_free(frame_cache, huge->frame);
+		}
+	}
+
+	slab_cache_free(page_cache, huge);
+
+	__atomic_add_fetch(&vmm_thp_splits, 1, __ATOMIC_RELAXED);
+}
+
+static int vmm_anon_map_huge(struct page_table *page_table, struct mmap_region *region, uintptr_t address, uint64_t flags) {
+	uintptr_t vaddr = address & ~(VMM_HUGE_PAGE_SIZE - 1);
+
+	if((region->flags & MMAP_MAP_ANONYMOUS) == 0 || (region->flags & MMAP_MAP_SHARED) || (flags & VMM_FLAGS_P) == 0) {
+		return -1;
+	}
+
+	if(vaddr < region->base || vaddr + VMM_HUGE_PAGE_SIZE > region->base + region->limit) {
+		return -1;
+	}
+
+	uint64_t frame_addr = -1;
+
+	if(page_table->lowest_level(page_table, vaddr) == NULL) {
+		frame_addr = pmm_alloc(VMM_HUGE_PAGE_SIZE / PAGE_SIZE, VMM_HUGE_PAGE_SIZE / PAGE_SIZE);
+	}
+
+	if(frame_addr == -1) {
+		__atomic_add_fetch(&vmm_thp_fallbacks, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	struct frame *frame = slab_cache_alloc(frame_cache);
+	frame->addr = frame_addr;
+
+	struct page *new_page = slab_cache_alloc_nozero(page_cache);
+	*new_page = (struct page) {
+		.vaddr = vaddr,
+		.frame = frame,
+		.size = VMM_HUGE_PAGE_SIZE,
+		.flags = flags | VMM_FLAGS_PS,
+		.pml_entry = page_table->map_page(page_table, vaddr, frame_addr, flags | VMM_FLAGS_PS),
+		.reference = alloc(sizeof(int))
+	};
+
+	*(new_page->reference) = 1;
+
+	vmm_page_insert(page_table, new_page);
+
+	__atomic_add_fetch(&vmm_thp_faults, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void vmm_print_thp_stats() {
+	print("vmm: huge page faults %d fallbacks %d splits %d split copies %d\n", vmm_thp_faults, vmm_thp_fallbacks,
+		vmm_thp_splits, vmm_thp_split_copies);
+}
+
+// a fault maps the whole naturally aligned window of VMM_FAULT_AROUND_PAGES pages around the
+// faulting address that lies inside the region. the window never crosses a pml1 table, so the
+// table unshared for the faulting page covers all of it
+
+struct vmm_fault_stats {
+	size_t faults;
+	size_t anon;
+	size_t file;
+	size_t cow;
+	size_t failed;
+
+	size_t around_pages;
+	size_t populated_pages;
+
+	size_t zero_maps;
+	size_t zero_breaks;
+
+	uint64_t cycles;
+	uint64_t max_cycles;
+};
+
+static struct vmm_fault_stats vmm_fault_stats;
+
+static uint64_t vmm_region_flags(struct mmap_region *region) {
+	uint64_t flags = VMM_FLAGS_P | VMM_FLAGS_NX;
+
+	if(region->prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
+	if(region->prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
+	if(region->prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
+	if(region->prot & MMAP_PROT_NONE) flags &= ~(VMM_FLAGS_P);
+
+	return flags;
+}
+
+static void vmm_fault_window(struct mmap_region *region, uintptr_t vaddr, uintptr_t *start, uintptr_t *end) {
+	size_t window = VMM_FAULT_AROUND_PAGES * PAGE_SIZE;
+
+	*start = vaddr & ~(window - 1);
+	*end = *start + window;
+
+	if(*start < region->base) *start = region->base;
+	if(*end > region->base + region->limit) *end = region->base + region->limit;
+}
+
+// frames for user pages come from here, memory pressure is dealt with on the way since faults
+// run without locks held
+
+static uint64_t vmm_alloc_frame(bool zero) {
+	uint64_t frame = zero ? pmm_alloc(1, 1) : pmm_alloc_nozero(1, 1);
+
+	for(size_t i = 0; frame == -1 && i < VMM_RECLAIM_ATTEMPTS; i++) {
+		vmm_reclaim(VMM_RECLAIM_BATCH);
+		frame = zero ? pmm_alloc(1, 1) : pmm_alloc_nozero(1, 1);
+	}
+
+	if(frame == -1) {
+		panic("vmm: out of memory");
+	}
+
+	return frame;
+}
+
+static void vmm_alloc_frames(uint64_t *frames, size_t cnt, bool zero) {
+	size_t done = pmm_alloc_batch(frames, cnt, zero);
+
+	for(size_t i = 0; done < cnt && i < VMM_RECLAIM_ATTEMPTS; i++) {
+		vmm_reclaim(VMM_RECLAIM_BATCH);
+		done += pmm_alloc_batch(frames + done, cnt - done, zero);
+	}
+
+	if(done < cnt) {
+		panic("vmm: out of memory");
+	}
+}
+
+// maps cnt fresh anonymous pages from vaddr on, the run must not leave its 2MiB block. with
+// zero_page every page gets the zero frame, read only and cow. the cow flag goes on even in a
+// read only region, it is what keeps a later mprotect from making the shared frame writable
+
+static void vmm_anon_map_run(struct page_table *page_table, uintptr_t vaddr, size_t cnt, uint64_t flags, bool zero_page) {
+	uint64_t frames[VMM_MAP_BATCH];
+
+	if(zero_page) {
+		flags = (flags & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+
+		for(size_t i = 0; i < cnt; i++) {
+			frames[i] = vmm_zero_frame;
+		}
+
+		__atomic_add_fetch(&vmm_fault_stats.zero_maps, cnt, __ATOMIC_RELAXED);
+	} else if(cnt == 1) { // a lone page is cheaper off the per cpu lists
+		frames[0] = vmm_alloc_frame(true);
+	} else {
+		vmm_alloc_frames(frames, cnt, true);
+	}
+
+	uint64_t *entry = vmm_map_pages(page_table, vaddr, frames, cnt, flags);
+
+	for(size_t i = 0; i < cnt; i++) {
+		struct frame *frame = slab_cache_alloc(frame_cache);
+		frame->addr = frames[i];
+
+		struct page *new_page = slab_cache_alloc_nozero(page_cache);
+		*new_page = (struct page) {
+			.vaddr = vaddr + i * PAGE_SIZE,
+			.frame = frame,
+			.size = PAGE_SIZE,
+			.flags = flags,
+			.pml_entry = entry + i,
+			.reference = alloc(sizeof(int))
+		};
+
+		*(new_page->reference) = 1;
+
+		vmm_page_insert(page_table, new_page);
+	}
+}
+
+// maps every page in [start, end) that has no page yet, a run at a time. returns the number of
+// pages mapped
+
+static size_t vmm_anon_map_gaps(struct page_table *page_table, uintptr_t start, uintptr_t end, uint64_t flags, bool zero_page) {
+	size_t mapped = 0;
+
+	for(uintptr_t vaddr = start; vaddr < end;) {
+		uintptr_t next = vaddr;
+		struct page *page = vmm_page_next(page_table, &next);
+
+		uintptr_t run_end = page && next < end ? next : end;
+		uintptr_t block_end = (vaddr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE;
+
+		if(run_end > block_end) {
+			run_end = block_end;
+		}
+
+		if(run_end > vaddr) {
+			vmm_anon_map_run(page_table, vaddr, (run_end - vaddr) / PAGE_SIZE, flags, zero_page);
+			mapped += (run_end - vaddr) / PAGE_SIZE;
+			vaddr = run_end;
+		} else {
+			vaddr = page->vaddr + page->size;
+		}
+	}
+
+	return mapped;
+}
+
+// file mappings start out with no pages at all. a page wholly inside the region's file_size
+// maps the page cache frame itself, shared mappings writable and private ones read only until
+// the first write copies it. the page holding the end of file_size gets a private copy of its
+// first bytes, anything past it reads as zero
+
+static int vmm_file_fault_page(struct page_table *page_table, struct mmap_region *region, uintptr_t vaddr) {
+	size_t region_offset = vaddr - region->base;
+	off_t offset = (region->offset & ~(PAGE_SIZE - 1)) + region_offset;
+
+	uint64_t flags = vmm_region_flags(region);
+	bool cacheable = pcache_enabled(region->file);
+
+	struct pcache_page *cached = NULL;
+	struct frame *frame;
+
+	if(cacheable && region_offset + PAGE_SIZE <= region->file_size) {
+		cached = pcache_get(region->file, offset);
+		if(cached == NULL) {
+			return -1;
+		}
+
+		frame = &cached->frame;
+
+		if(region->flags & MMAP_MAP_SHARED) {
+			flags |= VMM_SHARE_FLAG;
+		} else { // cow whatever the protection, mprotect must not open the file's frame for writing
+			flags = (flags & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+		}
+	} else {
+		frame = slab_cache_alloc(frame_cache);
+		frame->addr = vmm_alloc_frame(true);
+
+		if(region_offset < region->file_size) {
+			size_t cnt = region->file_size - region_offset;
+			if(cnt > PAGE_SIZE) {
+				cnt = PAGE_SIZE;
+			}
+
+			struct pcache_page *source = cacheable ? pcache_get(region->file, offset) : NULL;
+
+			if(source) {
+				memcpy8((void*)(frame->addr + HIGH_VMA), (void*)(source->frame.addr + HIGH_VMA), cnt);
+				pcache_put(source);
+			} else {
+				region->file->ops->read(region->file, (void*)(frame->addr + HIGH_VMA), cnt, offset);
+			}
+		}
+	}
+
+	invlpg(vaddr);
+
+	struct page *new_page = slab_cache_alloc_nozero(page_cache);
+	*new_page = (struct page) {
+		.vaddr = vaddr,
+		.frame = frame,
+		.size = PAGE_SIZE,
+		.flags = flags,
+		.file = region->file,
+		.offset = offset,
+		.cached = cached,
+		.pml_entry = page_table->map_page(page_table, vaddr, frame->addr, flags),
+		.reference = alloc(sizeof(int))
+	};
+
+	*(new_page->reference) = 1;
+
+	vmm_page_insert(page_table, new_page);
+
+	return 0;
+}
+
+static bool vmm_file_fill(struct page_table *page_table, struct mmap_region *region, uintptr_t vaddr) {
+	if(region->file == NULL || vmm_page_search(page_table, vaddr)) {
+		return false;
+	}
+
+	return vmm_file_fault_page(page_table, region, vaddr) == 0;
+}
+
+int vmm_file_map(struct page_table *page_table, struct mmap_region *region, uintptr_t address) {
+	uint64_t faulting_page = address & ~(0xfff);
+
+	if(!vmm_file_fill(page_table, region, faulting_page) && vmm_page_search(page_table, faulting_page) == NULL) {
+		return -1;
+	}
+
+	uintptr_t start, end;
+	vmm_fault_window(region, faulting_page, &start, &end);
+
+	for(uintptr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+		if(vaddr != faulting_page && vmm_file_fill(page_table, region, vaddr)) {
+			__atomic_add_fetch(&vmm_fault_stats.around_pages, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return 0;
+}
+
+int vmm_anon_map(struct page_table *page_table, struct mmap_region *region, uintptr_t address, bool write) {
+	uint64_t flags = vmm_region_flags(region);
+	uint64_t faulting_page = address & ~(0xfff);
+
+	// reads never get memory of their own, neither do their neighbours
+	if(write && vmm_anon_map_huge(page_table, region, address, flags) == 0) {
+		return 0;
+	}
+
+	uintptr_t start, end;
+	vmm_fault_window(region, faulting_page, &start, &end);
+
+	size_t mapped = vmm_anon_map_gaps(page_table, start, end, flags, !write);
+
+	if(mapped > 1) {
+		__atomic_add_fetch(&vmm_fault_stats.around_pages, mapped - 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+// MAP_POPULATE, everything in the range is faulted in up front in a single pass
+
+void vmm_populate(struct page_table *page_table, uintptr_t base, size_t length) {
+	uintptr_t vaddr = base;
+	size_t populated = 0;
+
+	while(vaddr < base + length) {
+		struct mmap_region *region = mmap_region_search(page_table, vaddr);
+		if(region == NULL) {
+			vaddr += PAGE_SIZE;
+			continue;
+		}
+
+		struct page *page = vmm_page_search(page_table, vaddr);
+
+		if(page) {
+			vaddr = page->vaddr + page->size;
+			continue;
+		}
+
+		if(region->file) {
+			if(vmm_file_fault_page(page_table, region, vaddr) == 0) {
+				populated++;
+			}
+		} else if(region->flags & MMAP_MAP_ANONYMOUS) {
+			uint64_t flags = vmm_region_flags(region);
+
+			if((vaddr & (VMM_HUGE_PAGE_SIZE - 1)) == 0 && vmm_anon_map_huge(page_table, region, vaddr, flags) == 0) {
+				populated += VMM_HUGE_PAGE_SIZE / PAGE_SIZE;
+				vaddr += VMM_HUGE_PAGE_SIZE;
+				continue;
+			}
+
+			// the rest of the 2MiB block in one go
+			uintptr_t end = (vaddr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE;
+
+			if(end > region->base + region->limit) end = region->base + region->limit;
+			if(end > base + length) end = base + length;
+
+			populated += vmm_anon_map_gaps(page_table, vaddr, end, flags, false);
+			vaddr = end;
+			continue;
+		}
+
+		vaddr += PAGE_SIZE;
+	}
+
+	__atomic_add_fetch(&vmm_fault_stats.populated_pages, populated, __ATOMIC_RELAXED);
+}
+
+void vmm_print_fault_stats() {
+	struct vmm_fault_stats *stats = &vmm_fault_stats;
+
+	print("vmm: faults %d anon %d file %d cow %d failed %d fault around window %d pages\n",
+		stats->faults, stats->anon, stats->file, stats->cow, stats->failed, VMM_FAULT_AROUND_PAGES);
+	print("vmm: pages mapped around faults %d populated %d\n", stats->around_pages, stats->populated_pages);
+	print("vmm: zero page maps %d broken by writes %d\n", stats->zero_maps, stats->zero_breaks);
+
+	if(stats->faults) {
+		print("vmm: fault handler cycles average %d max %d\n", stats->cycles / stats->faults, stats->max_cycles);
+	}
+}
+
+// any fault inside a shared table either writes to it or is about to change a mapping in it
+
+static void vmm_unshare_fault(struct page_table *page_table, uintptr_t vaddr) {
+	spinlock_irqsave(&page_table->lock);
+
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, vaddr, 0);
+	if(pml2_entry) {
+		vmm_unshare_locked(page_table, pml2_entry, vaddr);
 	}
 
-	uint64_t faulting_address;
-	asm volatile ("mov %%cr2, %0" : "=a"(faulting_address));
+	spinrelease_irqsave(&page_table->lock);
+}
+
+// mremap hands whole pml2 entries over where source and destination agree modulo 2MiB, so huge
+// pages and whole tables move as they are. everything else moves one pte at a time, either way no
+// data is copied and the page records only change their address. a table still shared since fork
+// is unshared first, its records carry the address of the other side too
+
+#define VMM_TABLE_FLAGS (VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_US)
+
+static bool vmm_table_empty(uint64_t pml2_entry) {
+	uint64_t *pml1 = (uint64_t*)((pml2_entry & ~(0xfff)) + HIGH_VMA);
+
+	for(size_t i = 0; i < 512; i++) {
+		if(pml1[i] & (VMM_FLAGS_P | VMM_SWAP_FLAG)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void vmm_move_record(struct page_table *page_table, struct page *page, uintptr_t delta) {
+	vmm_page_delete(page_table, page->vaddr);
+	page->vaddr += delta;
+	vmm_page_insert(page_table, page);
+}
+
+// nothing may be mapped at the destination. returns the number of page records moved, *tables
+// is increased by the number of pml2 entries that went over whole
+
+size_t vmm_move_range(struct page_table *page_table, uintptr_t src, uintptr_t dst, size_t length, size_t *tables) {
+	uintptr_t end = src + length;
+	uintptr_t delta = dst - src;
+	size_t moved = 0;
+
+	// huge pages straddling either end keep their outer part
+	if(src & (VMM_HUGE_PAGE_SIZE - 1)) {
+		vmm_split_huge_page(page_table, src);
+	}
+
+	if(end & (VMM_HUGE_PAGE_SIZE - 1)) {
+		vmm_split_huge_page(page_table, end);
+	}
+
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table, TLB_REASON_MREMAP);
+
+	spinlock_irqsave(&page_table->lock);
+
+	struct page *page;
+	uintptr_t vaddr = src;
+
+	while((page = vmm_page_next(page_table, &vaddr)) && vaddr < end) {
+		uintptr_t block = vaddr & ~(VMM_HUGE_PAGE_SIZE - 1);
+
+		uint64_t *src_pml2 = vmm_pml2_entry(page_table, vaddr, 0);
+		uint64_t *dst_pml2 = vmm_pml2_entry(page_table, vaddr + delta, VMM_TABLE_FLAGS);
+
+		if(src_pml2 == NULL || dst_pml2 == NULL || (*src_pml2 & VMM_FLAGS_P) == 0) { // nothing mapped behind the record
+			if(dst_pml2 && (*dst_pml2 & VMM_PT_COW_FLAG)) {
+				vmm_unshare_locked(page_table, dst_pml2, vaddr + delta);
+				continue;
+			}
+
+			vmm_move_record(page_table, page, delta);
+			moved++;
+			vaddr += PAGE_SIZE;
+			continue;
+		}
+
+		// both tables get written to or have their records moved, the lock is dropped on the way
+		// so look the page up again
+		if(*src_pml2 & VMM_PT_COW_FLAG) {
+			vmm_unshare_locked(page_table, src_pml2, vaddr);
+			continue;
+		}
+
+		if(block >= src && block + VMM_HUGE_PAGE_SIZE <= end && (delta & (VMM_HUGE_PAGE_SIZE - 1)) == 0 &&
+			((*dst_pml2 & VMM_FLAGS_P) == 0 || ((*dst_pml2 & (VMM_FLAGS_PS | VMM_PT_COW_FLAG)) == 0 && vmm_table_empty(*dst_pml2)))) {
+			uint64_t old_dst = (*dst_pml2 & VMM_FLAGS_P) ? *dst_pml2 : 0;
+
+			*dst_pml2 = *src_pml2;
+			*src_pml2 = old_dst; // an empty table left behind by munmap takes the place of the source
+
+			for(uintptr_t addr = block; (page = vmm_page_next(page_table, &addr)) && addr < block + VMM_HUGE_PAGE_SIZE; addr += PAGE_SIZE) {
+				if(page->size == VMM_HUGE_PAGE_SIZE) {
+					page->pml_entry = dst_pml2;
+				}
+
+				tlb_batch_add(&batch, addr);
+				vmm_move_record(page_table, page, delta);
+				moved++;
+			}
+
+			tlb_batch_add(&batch, block + delta);
+			(*tables)++;
+
+			vaddr = block + VMM_HUGE_PAGE_SIZE;
+			continue;
+		}
+
+		if(*src_pml2 & VMM_FLAGS_PS) { // the destination can not take the huge page whole
+			spinrelease_irqsave(&page_table->lock);
+			vmm_split_huge_page(page_table, vaddr);
+			spinlock_irqsave(&page_table->lock);
+			continue;
+		}
+
+		if((*dst_pml2 & VMM_FLAGS_P) == 0) {
+			*dst_pml2 = pmm_alloc(1, 1) | VMM_TABLE_FLAGS;
+		}
+
+		if(*dst_pml2 & VMM_PT_COW_FLAG) {
+			vmm_unshare_locked(page_table, dst_pml2, vaddr + delta);
+			continue;
+		}
+
+		uint64_t *src_pte = (uint64_t*)((*src_pml2 & ~(0xfff)) + HIGH_VMA) + ((vaddr >> 12) & 0x1ff);
+		uint64_t *dst_pte = (uint64_t*)((*dst_pml2 & ~(0xfff)) + HIGH_VMA) + (((vaddr + delta) >> 12) & 0x1ff);
+
+		*dst_pte = *src_pte;
+		*src_pte = 0;
+
+		page->pml_entry = dst_pte;
+
+		tlb_batch_add(&batch, vaddr);
+		vmm_move_record(page_table, page, delta);
+		moved++;
+
+		vaddr += PAGE_SIZE;
+	}
+
+	vmm_tlb_stale(page_table);
+
+	spinrelease_irqsave(&page_table->lock);
+
+	tlb_batch_flush(&batch);
+
+	return moved;
+}
+
+// anonymous memory is aged with the accessed bit. vmm_reclaim sweeps the address spaces like a
+// clock hand, a page used since the last sweep only loses its accessed bit, one that was not is
+// written to swap and its pte replaced by the slot. only private 4KiB pages that no fork sibling
+// or futex shares and whose pml1 table belongs to this address space alone are considered
+
+struct vmm_reclaim_stats {
+	size_t runs;
+	size_t scanned;
+	size_t referenced;
+	size_t swapped_out;
+	size_t write_errors;
+	size_t cycles;
+
+	size_t swap_ins;
+	size_t busy_retries;
+	size_t swap_in_cycles;
+	size_t max_swap_in_cycles;
+};
+
+static VECTOR(struct page_table*) vmm_table_list;
+static struct spinlock vmm_table_list_lock;
+static size_t vmm_reclaim_hand;
+static struct page_table *vmm_reclaim_target; // the address space being swept right now
+
+static char vmm_reclaim_lock;
+
+static struct vmm_reclaim_stats vmm_reclaim_stats;
+
+static void vmm_list_table(struct page_table *page_table) {
+	spinlock_irqsave(&vmm_table_list_lock);
+	VECTOR_PUSH(vmm_table_list, page_table);
+	spinrelease_irqsave(&vmm_table_list_lock);
+}
+
+// once this returns no sweep looks at the address space anymore
+
+void vmm_unlist_table(struct page_table *page_table) {
+	spinlock_irqsave(&vmm_table_list_lock);
+	VECTOR_REMOVE_BY_VALUE(vmm_table_list, page_table);
+	spinrelease_irqsave(&vmm_table_list_lock);
+
+	while(__atomic_load_n(&vmm_reclaim_target, __ATOMIC_ACQUIRE) == page_table) {
+		tlb_poll();
+		asm volatile ("pause");
+	}
+}
+
+// the pml1 entry for vaddr with the page table lock held, NULL inside shared tables
+
+static uint64_t *vmm_pte_locked(struct page_table *page_table, uintptr_t vaddr) {
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, vaddr, 0);
+	if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_P) == 0 || (*pml2_entry & (VMM_FLAGS_PS | VMM_PT_COW_FLAG))) {
+		return NULL;
+	}
+
+	return (uint64_t*)((*pml2_entry & ~(0xfff)) + HIGH_VMA) + ((vaddr >> 12) & 0x1ff);
+}
+
+// the pte of a page that may go to swap, the page table lock is held
+
+static uint64_t *vmm_reclaim_candidate(struct page_table *page_table, struct page *page) {
+	if(page->size != PAGE_SIZE || page->cached || (page->flags & (VMM_SHARE_FLAG | VMM_SWAP_FLAG)) ||
+		*page->reference != 1 || page->frame->locks.length) {
+		return NULL;
+	}
+
+	uint64_t *entry = vmm_pte_locked(page_table, page->vaddr);
+	if(entry == NULL || (*entry & VMM_FLAGS_P) == 0 || (*entry & VMM_PTE_ADDR_MASK) == vmm_zero_frame) {
+		return NULL;
+	}
+
+	return entry;
+}
+
+// a fault on the page while it is written out finds the slot busy and simply retries
+
+static bool vmm_swap_out(struct page_table *page_table, uintptr_t vaddr) {
+	int64_t slot = swap_alloc();
+	if(slot == -1) {
+		return false;
+	}
+
+	spinlock_irqsave(&page_table->lock);
+
+	struct page *page = vmm_page_search(page_table, vaddr);
+	uint64_t *entry = page ? vmm_reclaim_candidate(page_table, page) : NULL;
+
+	if(entry == NULL || (*entry & VMM_FLAGS_A)) {
+		spinrelease_irqsave(&page_table->lock);
+		swap_unbusy(slot);
+		swap_free(slot);
+		return false;
+	}
+
+	uint64_t old_entry = *entry;
+	uint64_t frame = old_entry & VMM_PTE_ADDR_MASK;
+	uint64_t swap_entry = (slot << 12) | (old_entry & 0xfff & ~(VMM_FLAGS_P | VMM_FLAGS_A | VMM_FLAGS_D)) |
+		(old_entry & VMM_FLAGS_NX) | VMM_SWAP_FLAG;
+
+	*entry = swap_entry;
+	page->flags |= VMM_SWAP_FLAG;
+
+	vmm_tlb_stale(page_table);
+	invlpg(vaddr);
+
+	spinrelease_irqsave(&page_table->lock);
+
+	tlb_shootdown(page_table, vaddr, TLB_REASON_RECLAIM);
+
+	if(swap_write(slot, frame) == -1) { // the frame is still good, put it back
+		spinlock_irqsave(&page_table->lock);
+
+		page = vmm_page_search(page_table, vaddr);
+		entry = vmm_pte_locked(page_table, vaddr);
+
+		if(page && entry && *entry == swap_entry) {
+			*entry = old_entry & ~(VMM_FLAGS_A | VMM_FLAGS_D);
+			page->flags &= ~(VMM_SWAP_FLAG);
+		}
+
+		spinrelease_irqsave(&page_table->lock);
+
+		swap_unbusy(slot);
+		swap_free(slot);
+
+		__atomic_add_fetch(&vmm_reclaim_stats.write_errors, 1, __ATOMIC_RELAXED);
+
+		return false;
+	}
+
+	swap_unbusy(slot);
+	pmm_free(frame, 1);
+
+	return true;
+}
+
+// one stretch of the clock over a single address space, the cursor wraps to 0 at its end
+
+static size_t vmm_reclaim_table(struct page_table *page_table, size_t page_cnt, size_t *budget) {
+	struct vmm_reclaim_stats *stats = &vmm_reclaim_stats;
+	uintptr_t vaddr = page_table->reclaim_cursor;
+	size_t reclaimed = 0;
+
+	while(reclaimed < page_cnt && *budget) {
+		spinlock_irqsave(&page_table->lock);
+
+		struct page *page = vmm_page_next(page_table, &vaddr);
+		if(page == NULL) {
+			spinrelease_irqsave(&page_table->lock);
+			vaddr = 0;
+			break;
+		}
+
+		(*budget)--;
+		__atomic_add_fetch(&stats->scanned, 1, __ATOMIC_RELAXED);
+
+		uint64_t *entry = vmm_reclaim_candidate(page_table, page);
+		uintptr_t next = page->vaddr + page->size;
+
+		if(entry == NULL) {
+			spinrelease_irqsave(&page_table->lock);
+			vaddr = next;
+			continue;
+		}
 
+		if(*entry & VMM_FLAGS_A) { // a stale tlb entry only means the bit is not set again right away
+			__atomic_and_fetch(entry, ~(VMM_FLAGS_A), __ATOMIC_RELAXED);
+			spinrelease_irqsave(&page_table->lock);
+
+			__atomic_add_fetch(&stats->referenced, 1, __ATOMIC_RELAXED);
+			vaddr = next;
+			continue;
+		}
+
+		spinrelease_irqsave(&page_table->lock);
+
+		if(vmm_swap_out(page_table, vaddr)) {
+			reclaimed++;
+		}
+
+		vaddr = next;
+	}
+
+	page_table->reclaim_cursor = vaddr;
+
+	return reclaimed;
+}
+
+static size_t vmm_reclaim_anon(size_t page_cnt) {
+	size_t reclaimed = 0;
+	size_t budget = VMM_RECLAIM_SCAN_MAX;
+
+	spinlock_irqsave(&vmm_table_list_lock);
+	size_t table_cnt = vmm_table_list.length;
+	spinrelease_irqsave(&vmm_table_list_lock);
+
+	// two rounds, the first may only have cleared accessed bits
+	for(size_t i = 0; i < table_cnt * 2 && reclaimed < page_cnt && budget; i++) {
+		spinlock_irqsave(&vmm_table_list_lock);
+
+		if(vmm_table_list.length == 0) {
+			spinrelease_irqsave(&vmm_table_list_lock);
+			break;
+		}
+
+		struct page_table *page_table = vmm_table_list.data[vmm_reclaim_hand++ % vmm_table_list.length];
+		__atomic_store_n(&vmm_reclaim_target, page_table, __ATOMIC_RELEASE);
+
+		spinrelease_irqsave(&vmm_table_list_lock);
+
+		reclaimed += vmm_reclaim_table(page_table, page_cnt - reclaimed, &budget);
+
+		__atomic_store_n(&vmm_reclaim_target, NULL, __ATOMIC_RELEASE);
+	}
+
+	return reclaimed;
+}
+
+// clean page cache pages are the cheapest to give up, anonymous memory only goes to swap when
+// the cache could not cover the request. one cpu reclaims at a time, the others wait for it and
+// then try their allocation again
+
+size_t vmm_reclaim(size_t page_cnt) {
+	if(__atomic_test_and_set(&vmm_reclaim_lock, __ATOMIC_ACQUIRE)) {
+		while(__atomic_load_n(&vmm_reclaim_lock, __ATOMIC_ACQUIRE)) {
+			tlb_poll();
+			asm volatile ("pause");
+		}
+
+		return 0;
+	}
+
+	uint64_t start = rdtsc();
+
+	size_t reclaimed = pcache_reclaim(page_cnt);
+	size_t swapped = 0;
+
+	if(reclaimed < page_cnt && swap_enabled()) {
+		swapped = vmm_reclaim_anon(page_cnt - reclaimed);
+	}
+
+	struct vmm_reclaim_stats *stats = &vmm_reclaim_stats;
+
+	__atomic_add_fetch(&stats->runs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->swapped_out, swapped, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->cycles, rdtsc() - start, __ATOMIC_RELAXED);
+
+	__atomic_clear(&vmm_reclaim_lock, __ATOMIC_RELEASE);
+
+	return reclaimed + swapped;
+}
+
+// a major fault. the slot is only given up once the pte points at the new frame
+
+static int vmm_swap_in(struct page_table *page_table, uintptr_t vaddr) {
+	struct vmm_reclaim_stats *stats = &vmm_reclaim_stats;
+	uint64_t start = rdtsc();
+
+	spinlock_irqsave(&page_table->lock);
+	uint64_t *entry = vmm_pte_locked(page_table, vaddr);
+	uint64_t swap_entry = entry ? *entry : 0;
+	spinrelease_irqsave(&page_table->lock);
+
+	if((swap_entry & VMM_SWAP_FLAG) == 0 || (swap_entry & VMM_FLAGS_P)) { // somebody else was quicker
+		return 0;
+	}
+
+	uint64_t slot = (swap_entry & VMM_PTE_ADDR_MASK) >> 12;
+
+	if(swap_busy(slot)) { // still on its way out, the access faults again until it is done
+		__atomic_add_fetch(&stats->busy_retries, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	uint64_t frame = vmm_alloc_frame(false);
+
+	if(swap_read(slot, frame) == -1) {
+		pmm_free(frame, 1);
+		return -1;
+	}
+
+	spinlock_irqsave(&page_table->lock);
+
+	struct page *page = vmm_page_search(page_table, vaddr);
+	entry = vmm_pte_locked(page_table, vaddr);
+
+	if(page == NULL || entry == NULL || *entry != swap_entry) {
+		spinrelease_irqsave(&page_table->lock);
+		pmm_free(frame, 1);
+		return 0;
+	}
+
+	if(*page->reference > 1) { // forked while swapped out, the other side keeps the slot
+		(*page->reference)--;
+
+		page->reference = alloc(sizeof(int));
+		*page->reference = 1;
+		page->frame = slab_cache_alloc(frame_cache);
+	}
+
+	page->frame->addr = frame;
+	page->flags &= ~(VMM_SWAP_FLAG);
+
+	*entry = frame | (swap_entry & 0xfff) | (swap_entry & VMM_FLAGS_NX) | VMM_FLAGS_P;
+
+	spinrelease_irqsave(&page_table->lock);
+
+	swap_free(slot);
+
+	uint64_t cycles = rdtsc() - start;
+
+	__atomic_add_fetch(&stats->swap_ins, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->swap_in_cycles, cycles, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&stats->max_swap_in_cycles, __ATOMIC_RELAXED);
+	while(cycles > max && !__atomic_compare_exchange_n(&stats->max_swap_in_cycles, &max, cycles, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+void vmm_print_reclaim_stats() {
+	struct vmm_reclaim_stats *stats = &vmm_reclaim_stats;
+
+	print("vmm: reclaim runs %d scanned %d referenced %d swapped out %d write errors %d\n",
+		stats->runs, stats->scanned, stats->referenced, stats->swapped_out, stats->write_errors);
+
+	if(stats->runs) {
+		print("vmm: reclaim cycles average %d per run\n", stats->cycles / stats->runs);
+	}
+
+	print("vmm: major faults %d busy retries %d\n", stats->swap_ins, stats->busy_retries);
+
+	if(stats->swap_ins) {
+		print("vmm: swap in cycles average %d max %d\n", stats->swap_in_cycles / stats->swap_ins, stats->max_swap_in_cycles);
+	}
+}
+static int vmm_pf_resolve(struct registers *regs, struct task *task, uint64_t faulting_address) {
 	uint64_t faulting_page = faulting_address & ~(0xfff);
+
+	vmm_unshare_fault(task->page_table, faulting_page);
+
 	uint64_t *lowest_level = task->page_table->lowest_level(task->page_table, faulting_page);
 	uint64_t pmll_entry = lowest_level == NULL ? 0 : *lowest_level;
 
 	if((regs->error_code & VMM_FLAGS_P) == 0) {
-		if(pmll_entry & VMM_FILE_FLAG) {
-			return vmm_file_map(task->page_table, faulting_address);
+		if(pmll_entry & VMM_SWAP_FLAG) {
+			return vmm_swap_in(task->page_table, faulting_page);
+		}
+
+		struct mmap_region *region = mmap_region_search(task->page_table, faulting_address);
+		if(region == NULL) {
+			return -1;
+		}
+
+		if(region->file) {
+			__atomic_add_fetch(&vmm_fault_stats.file, 1, __ATOMIC_RELAXED);
+			return vmm_file_map(task->page_table, region, faulting_address);
 		}
-		return vmm_anon_map(task->page_table, faulting_address);
+
+		__atomic_add_fetch(&vmm_fault_stats.anon, 1, __ATOMIC_RELAXED);
+		return vmm_anon_map(task->page_table, region, faulting_address, regs->error_code & VMM_FLAGS_RW);
 	}
 
 	if(pmll_entry & VMM_COW_FLAG) {
-		struct page *page = hash_table_search(task->page_table->pages, &faulting_page, sizeof(faulting_page));
+		__atomic_add_fetch(&vmm_fault_stats.cow, 1, __ATOMIC_RELAXED);
+
+		struct page *page = vmm_page_search(task->page_table, faulting_page);
 		if(page == NULL) {
 			return -1;
 		}
 
+		struct mmap_region *region = mmap_region_search(task->page_table, faulting_address);
+		if(region && (region->prot & MMAP_PROT_WRITE) == 0) { // cow is no licence to write after mprotect
+			return -1;
+		}
+
+		// a huge page nobody else maps is made writable whole below, otherwise this side takes
+		// a private copy of it in 4KiB pages
+		if(page->size == VMM_HUGE_PAGE_SIZE && *page->reference > 1) {
+			vmm_split_huge_page(task->page_table, faulting_page);
+
+			page = vmm_page_search(task->page_table, faulting_page);
+			lowest_level = task->page_table->lowest_level(task->page_table, faulting_page);
+			pmll_entry = *lowest_level;
+		}
+
 		uint64_t original_frame = pmll_entry & ~(0xfff) & 0xffffffffff;
 		uint64_t new_frame;
 
-		if((*page->reference) <= 1) {
+		struct frame *old_frame = page->frame;
+
+		if(original_frame == vmm_zero_frame) { // a fresh zeroed frame is the copy
+			page->frame = slab_cache_alloc(frame_cache);
+			new_frame = vmm_alloc_frame(true);
+			__atomic_add_fetch(&vmm_fault_stats.zero_breaks, 1, __ATOMIC_RELAXED);
+		} else if((*page->reference) <= 1 && page->cached == NULL) { // page cache frames are never written in place
 			new_frame = original_frame;
 		} else {
-			page->frame = alloc(sizeof(struct frame));
-			new_frame = pmm_alloc(1, 1);
+			page->frame = slab_cache_alloc(frame_cache);
+			new_frame = vmm_alloc_frame(false);
 			memcpy64((uint64_t*)(new_frame + HIGH_VMA), (uint64_t*)(original_frame + HIGH_VMA), PAGE_SIZE / 8);
 		}
 
-		(*page->reference)--;
+		// the last record on the old frame struct keeps the reference count for the new one
+		if(--(*page->reference) == 0) {
+			if(page->frame != old_frame && page->cached == NULL && old_frame->locks.length == 0) {
+				slab_cache_free(frame_cache, old_frame);
+			}
+
+			(*page->reference) = 1;
+		} else {
+			page->reference = alloc(sizeof(int));
+			(*page->reference) = 1;
+		}
 
 		uint64_t entry = new_frame | ((pmll_entry & 0x1ff) | (VMM_FLAGS_RW));
 		*lowest_level = entry;
 
+		vmm_tlb_stale(task->page_table);
 		invlpg(faulting_address);
+		tlb_shootdown(task->page_table, faulting_page, TLB_REASON_COW);
 
 		page->frame->addr = new_frame;
-		page->reference = alloc(sizeof(int));
-		(*page->reference) = 1;
+
+		if(page->cached) { // the file's copy stays behind in the page cache
+			pcache_put(page->cached);
+			page->cached = NULL;
+		}
 
 		return 0;	
 	}
 
 	return -1;
 }
+
+int vmm_pf_handler(struct registers *regs) {
+	struct task *task = CURRENT_TASK;
+	if(task == NULL) {
+		return -1;
+	}
+
+	uint64_t faulting_address;
+	asm volatile ("mov %%cr2, %0" : "=a"(faulting_address));
+
+	uint64_t start = rdtsc();
+
+	if(pmm_free_page_cnt() < PMM_LOW_WATERMARK) {
+		vmm_reclaim(VMM_RECLAIM_BATCH);
+	}
+
+	int ret = vmm_pf_resolve(regs, task, faulting_address);
+
+	uint64_t cycles = rdtsc() - start;
+	struct vmm_fault_stats *stats = &vmm_fault_stats;
+
+	__atomic_add_fetch(&stats->faults, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->cycles, cycles, __ATOMIC_RELAXED);
+	if(ret == -1) {
+		__atomic_add_fetch(&stats->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	uint64_t max = __atomic_load_n(&stats->max_cycles, __ATOMIC_RELAXED);
+	while(cycles > max && !__atomic_compare_exchange_n(&stats->max_cycles, &max, cycles, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return ret;
+}
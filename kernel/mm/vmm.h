@@ -3,6 +3,7 @@
 #include <types.h>
 #include <vector.h>
 #include <lock.h>
+#include <radix.h>
 
 #define VMM_FLAGS_P (1 << 0)
 #define VMM_FLAGS_RW (1 << 1)
@@ -22,11 +23,29 @@
 #define VMM_PAT_WB 6
 #define VMM_PAT_UCM 7
 
+#define VMM_HUGE_PAGE_SIZE 0x200000
+
+#define VMM_FAULT_AROUND_PAGES 16 // a power of two, at most one pml1 table
+
+#define VMM_CR3_NOFLUSH (1ull << 63)
+#define VMM_PCID_SLOTS 16
+
 #define VMM_COW_FLAG (1 << 9)
 #define VMM_FILE_FLAG (1 << 10)
 #define VMM_SHARE_FLAG (1 << 11)
+#define VMM_PT_COW_FLAG (1 << 9) // on a pml2 entry: the pml1 table below is shared since fork
+#define VMM_SWAP_FLAG (1ull << 52) // non present pte with the swap slot in bits 12 to 51, mirrored in page->flags
+
+#define VMM_PTE_ADDR_MASK 0xffffffffff000ull
+#define VMM_MAP_BATCH 512 // one pml1 table
+
+#define VMM_RECLAIM_BATCH 64
+#define VMM_RECLAIM_SCAN_MAX 0x10000 // page records looked at per vmm_reclaim call
+#define VMM_RECLAIM_ATTEMPTS 4
 
 struct futex;
+struct pcache_page;
+struct tlb_batch;
 
 struct frame {
 	uint64_t addr;
@@ -41,6 +60,7 @@ struct page {
 
 	struct file_handle *file;
 	off_t offset;
+	struct pcache_page *cached; // frame belongs to the page cache, see mm/pcache.c
 
 	uint64_t *pml_entry;
 
@@ -55,9 +75,33 @@ struct mmap_region {
 	int fd;
 	off_t offset;
 
+	struct file_handle *file; // backing file of a file mapping, faulted in page by page
+	size_t file_size; // bytes from base on that come from the file, the rest reads as zero
+
 	struct mmap_region *left;
 	struct mmap_region *right;
-	struct mmap_region *parent;
+	int height;
+
+	uintptr_t subtree_base;
+	uintptr_t subtree_end;
+	size_t max_gap; // largest hole between regions of this subtree
+};
+
+struct vmm_pcid_slot {
+	struct page_table *page_table;
+	uint64_t id;
+	uint64_t tlb_generation;
+};
+
+struct vmm_pcid_cache {
+	struct vmm_pcid_slot slots[VMM_PCID_SLOTS]; // slot i is tagged with pcid i + 1
+	size_t next;
+	int active; // pcid currently in cr3, 0 when none of the slots is loaded
+
+	size_t hits;
+	size_t misses;
+	size_t flushes;
+	size_t skips;
 };
 
 struct page_table {
@@ -66,22 +110,52 @@ struct page_table {
 	uint64_t *(*lowest_level)(struct page_table *page_table, uintptr_t vaddr);
 
 	struct mmap_region *mmap_region_root;
-	uint64_t mmap_bump_base;
+	uint64_t mmap_min_addr;
 
-	struct hash_table *pages;
+	struct radix_tree pages; // struct vmm_page_block by 2MiB block, see mm/vmm.c
+	uintptr_t reclaim_cursor; // where vmm_reclaim stopped in this address space
 
 	uint64_t *pml_high;
 
+	uint64_t id;
+	uint64_t tlb_generation;
+
 	int refcnt;
 	struct spinlock lock;
 };
 
 extern struct page_table kernel_mappings;
+extern uint64_t vmm_zero_frame;
+
+// a huge page has a single record at its 2MiB aligned base
+struct page *vmm_page_search(struct page_table *page_table, uintptr_t vaddr);
+void vmm_page_insert(struct page_table *page_table, struct page *page);
+struct page *vmm_page_delete(struct page_table *page_table, uintptr_t vaddr);
+
+// first page at or above *vaddr, *vaddr is moved onto it
+struct page *vmm_page_next(struct page_table *page_table, uintptr_t *vaddr);
 
 void vmm_init();
 void vmm_init_page_table(struct page_table *page_table);
 void vmm_map_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt, uint64_t flags);
 void vmm_unmap_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt);
+uint64_t *vmm_map_pages(struct page_table *page_table, uintptr_t vaddr, const uint64_t *frames, size_t cnt, uint64_t flags);
+void vmm_unmap_pages(struct page_table *page_table, uintptr_t vaddr, size_t cnt, uint64_t *old, struct tlb_batch *batch);
+void vmm_protect_pages(struct page_table *page_table, uintptr_t vaddr, size_t cnt, uint64_t set, uint64_t clear, struct tlb_batch *batch);
 void vmm_default_table(struct page_table *page_table);
+size_t vmm_page_release(struct page *page, uint64_t entry);
+void vmm_get_page_table(struct page_table *page_table);
+void vmm_put_page_table(struct page_table *page_table);
 
 struct page_table *vmm_fork_page_table(struct page_table *page_table);
+void vmm_split_huge_page(struct page_table *page_table, uintptr_t vaddr);
+void vmm_populate(struct page_table *page_table, uintptr_t base, size_t length);
+size_t vmm_move_range(struct page_table *page_table, uintptr_t src, uintptr_t dst, size_t length, size_t *tables);
+void vmm_print_tlb_stats();
+void vmm_print_fork_stats();
+void vmm_print_teardown_stats();
+void vmm_print_thp_stats();
+void vmm_print_fault_stats();
+void vmm_unlist_table(struct page_table *page_table);
+size_t vmm_reclaim(size_t page_cnt);
+void vmm_print_reclaim_stats();
@@ -97,7 +97,7 @@ struct fd_handle *search_socket(int sockfd) {
 }
 
 struct fd_handle *create_sockfd(struct socket *socket, struct file_handle *file_handle) {
-	struct fd_handle *socket_fd_handle = alloc(sizeof(struct fd_handle));
+	struct fd_handle *socket_fd_handle = slab_cache_alloc(fd_handle_cache);
 	struct file_handle *socket_file_handle = file_handle;
 	fd_init(socket_fd_handle);
 
@@ -122,7 +122,7 @@ struct fd_handle *create_sockfd(struct socket *socket, struct file_handle *file_
 }
 
 struct file_handle *socket_default_file(struct socket *socket) {
-	struct file_handle *socket_file_handle = alloc(sizeof(struct file_handle));
+	struct file_handle *socket_file_handle = slab_cache_alloc(file_handle_cache);
 	file_init(socket_file_handle);
 
 	socket_file_handle->ops = &socket_file_ops;
@@ -221,7 +221,7 @@ void syscall_socket(struct registers *regs) {
 		return;
 	}
 
-	struct file_handle *socket_file_handle = alloc(sizeof(struct file_handle));
+	struct file_handle *socket_file_handle = slab_cache_alloc(file_handle_cache);
 	file_init(socket_file_handle);
 
 	socket_file_handle->ops = &socket_file_ops;
@@ -78,7 +78,7 @@ static int unix_bind(struct socket *socket, const struct socketaddr *socketaddr,
 		return -1;
 	}
 
-	char *path = alloc(strlen(socketaddr_un->sun_path));
+	char *path = alloc(strlen(socketaddr_un->sun_path) + 1);
 	strcpy(path, socketaddr_un->sun_path);
 
 	while(*path == '/') path++;
@@ -118,6 +118,7 @@ static int unix_bind(struct socket *socket, const struct socketaddr *socketaddr,
 	}
 
 	socket->file_handle->vfs_node = path_node;
+	vfs_node_get(path_node);
 
 	*(struct socketaddr_un*)socket->addr = *socketaddr_un;
 
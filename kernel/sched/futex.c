@@ -12,13 +12,18 @@ int futex(uintptr_t uaddr, int ops, int expected, const struct timespec *timeout
 	}
 
 	uint64_t uaddr_page = uaddr & ~(0xfff);
-	struct page *page = hash_table_search(task->page_table->pages, &uaddr_page, sizeof(uaddr_page));
+	struct page *page = vmm_page_search(task->page_table, uaddr_page);
 	if(page == NULL) {
 		set_errno(EFAULT);
 		return -1;
 	}
 
-	uint64_t futex_paddr = page->frame->addr + (uaddr & (0xfff));
+	if(page->flags & VMM_SWAP_FLAG) { // touching the word brings it back from swap
+		(void)*(volatile uint32_t*)uaddr;
+		page = vmm_page_search(task->page_table, uaddr_page);
+	}
+
+	uint64_t futex_paddr = page->frame->addr + (uaddr - page->vaddr);
 
 	switch(ops) {
 		case FUTEX_WAIT: {
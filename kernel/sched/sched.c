@@ -67,6 +67,7 @@ void sched_idle() {
 	spinrelease_irqsave(&sched_lock);
 
 	for(;;) {
+		pmm_zero_pool_refill();
 		asm volatile ("hlt");
 	}
 }
@@ -121,6 +122,11 @@ void reschedule(struct registers *regs, void*) {
 	CORE_LOCAL->kernel_stack = next_task->kernel_stack.sp;
 	CORE_LOCAL->user_stack = next_task->user_stack.sp;
 
+	struct cpu_local *cpu_local = CORE_LOCAL;
+	uint64_t *context_switches = &cpu_local->context_switches;
+
+	next_task->cpu = cpu_local;
+
 	next_task->idle_cnt = 0;
 	next_task->idle_cnt = 0;
 	next_task->sched_status = TASK_RUNNING;
@@ -139,6 +145,7 @@ void reschedule(struct registers *regs, void*) {
 
 	asm volatile (
 		"mov %0, %%rsp\n\t"
+		"lock incq (%1)\n\t"
 		"pop %%r15\n\t"
 		"pop %%r14\n\t"
 		"pop %%r13\n\t"
@@ -156,7 +163,7 @@ void reschedule(struct registers *regs, void*) {
 		"pop %%rax\n\t"
 		"addq $16, %%rsp\n\t"
 		"iretq\n\t"
-		:: "r" (&next_task->regs)
+		:: "r" (&next_task->regs), "r" (context_switches)
 	);
 }
 
@@ -194,6 +201,77 @@ void sched_yield() {
 	}
 }
 
+// a task's kernel stacks are still underneath its cpu until reschedule has moved on to another
+// task, the stacks of tasks that are gone wait here for that to happen
+
+struct sched_dead_stack {
+	uint64_t base;
+	struct cpu_local *cpu;
+	uint64_t context_switches;
+};
+
+static VECTOR(struct sched_dead_stack) sched_dead_stacks;
+static struct spinlock sched_dead_lock;
+
+static size_t sched_stacks_live; // should come back to where it was once a fork and exit loop is over
+static size_t sched_stacks_freed;
+
+static void sched_free_dead_stacks() {
+	spinlock_irqsave(&sched_dead_lock);
+
+	for(size_t i = 0; i < sched_dead_stacks.length;) {
+		struct sched_dead_stack *dead = &sched_dead_stacks.data[i];
+
+		if(__atomic_load_n(&dead->cpu->context_switches, __ATOMIC_ACQUIRE) == dead->context_switches) {
+			i++;
+			continue;
+		}
+
+		pmm_free(dead->base, DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE));
+		VECTOR_REMOVE_BY_INDEX(sched_dead_stacks, i);
+
+		__atomic_sub_fetch(&sched_stacks_live, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&sched_stacks_freed, 1, __ATOMIC_RELAXED);
+	}
+
+	spinrelease_irqsave(&sched_dead_lock);
+}
+
+static uint64_t sched_alloc_stack() {
+	sched_free_dead_stacks();
+
+	__atomic_add_fetch(&sched_stacks_live, 1, __ATOMIC_RELAXED);
+
+	return pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+}
+
+// the task may still be running on the cpu it last ran on, one that never ran waits for this cpu
+// to switch instead
+
+static void sched_retire_stacks(struct task *task) {
+	struct cpu_local *cpu_local = task->cpu ? task->cpu : CORE_LOCAL;
+	uint64_t context_switches = __atomic_load_n(&cpu_local->context_switches, __ATOMIC_ACQUIRE);
+
+	struct stack *stacks[] = { &task->kernel_stack, &task->signal_kernel_stack };
+
+	spinlock_irqsave(&sched_dead_lock);
+
+	for(size_t i = 0; i < sizeof(stacks) / sizeof(stacks[0]); i++) {
+		VECTOR_PUSH(sched_dead_stacks, ((struct sched_dead_stack) {
+			.base = stacks[i]->sp - stacks[i]->size - HIGH_VMA,
+			.cpu = cpu_local,
+			.context_switches = context_switches
+		}));
+	}
+
+	spinrelease_irqsave(&sched_dead_lock);
+}
+
+void sched_print_stack_stats() {
+	print("sched: kernel stacks live %d freed %d waiting %d\n",
+		sched_stacks_live, sched_stacks_freed, sched_dead_stacks.length);
+}
+
 int sched_default_task(struct task *task, struct pid_namespace *namespace, int queue) {
 	spinlock_irqsave(&sched_lock);
 
@@ -242,10 +320,10 @@ int sched_default_task(struct task *task, struct pid_namespace *namespace, int q
 		task->parent = NULL;
 	}
 
-	task->kernel_stack.sp = pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+	task->kernel_stack.sp = sched_alloc_stack();
 	task->kernel_stack.size = THREAD_KERNEL_STACK_SIZE;
 
-	task->signal_kernel_stack.sp = pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+	task->signal_kernel_stack.sp = sched_alloc_stack();
 	task->signal_kernel_stack.size = THREAD_KERNEL_STACK_SIZE;
 
 	hash_table_push(&namespace->process_list, &task->id.pid, task, sizeof(task->id.pid));
@@ -264,7 +342,7 @@ int sched_default_task(struct task *task, struct pid_namespace *namespace, int q
 }
 
 /*struct task *sched_default_task(struct pid_namespace *namespace) {
-	struct task *task = alloc(sizeof(struct task));
+	struct task *task = slab_cache_alloc(task_cache);
 
 	spinlock_irqsave(&sched_lock);
 
@@ -601,13 +679,22 @@ finish:
 void task_terminate(struct task *task, int status) {
 	asm volatile ("cli");
 
-	task->fd_table->refcnt--;
-	if(task->fd_table->refcnt == 0) {
-		for(size_t i = 0; i < task->fd_table->fd_bitmap.size; i++) {
-			if(BIT_TEST(task->fd_table->fd_bitmap.data, i)) {
+	struct fd_table *fd_table = task->fd_table;
+
+	fd_table->refcnt--;
+	if(fd_table->refcnt == 0) {
+		for(size_t i = 0; i < fd_table->fd_bitmap.size; i++) {
+			if(BIT_TEST(fd_table->fd_bitmap.data, i)) {
 				fd_close(i);
 			}
 		}
+
+		free(fd_table->fd_list.keys);
+		free(fd_table->fd_list.data);
+		free(fd_table->fd_bitmap.data);
+		free(fd_table);
+
+		task->fd_table = NULL;
 	}
 
 	if(task->id.tid == 0) {
@@ -620,6 +707,11 @@ void task_terminate(struct task *task, int status) {
 			thread->sched_status = TASK_YIELD;
 			hash_table_delete(&task->thread_group->process_list, &thread->id.tid, sizeof(thread->id.tid));
 			VECTOR_REMOVE_BY_VALUE(task_queue, thread);
+
+			if(thread != task) { // the other threads never get to clean up after themselves
+				vmm_put_page_table(thread->page_table);
+				sched_retire_stacks(thread);
+			}
 		}
 	} else {
 		task->sched_status = TASK_YIELD;
@@ -627,25 +719,11 @@ void task_terminate(struct task *task, int status) {
 		VECTOR_REMOVE_BY_VALUE(task_queue, task);
 	}
 
-	struct page_table *page_table = task->page_table;
-
-	page_table->refcnt--;
-	if(page_table->refcnt == 0) {
-		for(size_t i = 0; i < page_table->pages->capacity; i++) {
-			struct page *page = page_table->pages->data[i];
-
-			if(page) {
-				hash_table_delete(page_table->pages, &page->vaddr, sizeof(page->vaddr));
-
-				if((*page->reference) <= 1) { // shared page
-					(*page->reference)--;
-					continue;
-				}
+	// nothing may run on the tables that go away below
+	vmm_init_page_table(&kernel_mappings);
+	CORE_LOCAL->page_table = &kernel_mappings;
 
-				pmm_free(page->frame->addr, 1);
-			}
-		}
-	}
+	vmm_put_page_table(task->page_table);
 
 	signal_send_task(NULL, task, SIGCHLD);
 
@@ -688,7 +766,7 @@ void task_terminate(struct task *task, int status) {
 	CORE_LOCAL->pid = -1;
 	CORE_LOCAL->tid = -1;
 
-	vmm_init_page_table(&kernel_mappings);
+	sched_retire_stacks(task);
 
 	asm volatile ("sti");
 
@@ -717,7 +795,7 @@ struct task *clone(int flags, void *child_stack, pid_t *ptid, pid_t *ctid, void
 		panic("");
 	}
 
-	struct task *task = alloc(sizeof(struct task));
+	struct task *task = slab_cache_alloc(task_cache);
 
 	if(((flags & CLONE_SIGHAND) == CLONE_SIGHAND && (flags & CLONE_VM) != CLONE_VM) ||
 		((flags & CLONE_THREAD) == CLONE_THREAD && (flags & CLONE_SIGHAND) != CLONE_SIGHAND) ||
@@ -746,7 +824,7 @@ struct task *clone(int flags, void *child_stack, pid_t *ptid, pid_t *ctid, void
 		for(size_t i = 0; i < current_task->fd_table->fd_list.capacity; i++) {
 			struct fd_handle *handle = current_task->fd_table->fd_list.data[i];
 			if(handle) {
-				struct fd_handle *new_handle = alloc(sizeof(struct fd_handle));
+				struct fd_handle *new_handle = slab_cache_alloc(fd_handle_cache);
 				*new_handle = *handle;
 				file_get(new_handle->file_handle);
 				hash_table_push(&task->fd_table->fd_list, &new_handle->fd_number, new_handle, sizeof(new_handle->fd_number));
@@ -766,6 +844,9 @@ struct task *clone(int flags, void *child_stack, pid_t *ptid, pid_t *ctid, void
 		task->umask = alloc(sizeof(task->umask));
 
 		*task->cwd = *current_task->cwd;
+		if(*task->cwd) {
+			vfs_node_get(*task->cwd);
+		}
 		*task->umask = *current_task->umask;
 	}
 
@@ -816,6 +897,8 @@ struct task *clone(int flags, void *child_stack, pid_t *ptid, pid_t *ctid, void
 
 	if((flags & CLONE_VM) == CLONE_VM) {
 		task->page_table = current_task->page_table;
+		vmm_get_page_table(task->page_table);
+
 		task->regs.rsp = (uint64_t)child_stack;
 
 		task->user_stack = (struct stack) {
@@ -871,10 +954,10 @@ struct task *clone(int flags, void *child_stack, pid_t *ptid, pid_t *ctid, void
 	task->waitq = alloc(sizeof(struct waitq));
 	task->status_trigger = EVENT_DEFAULT_TRIGGER(CURRENT_TASK->waitq);
 
-	task->kernel_stack.sp = pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+	task->kernel_stack.sp = sched_alloc_stack();
 	task->kernel_stack.size = THREAD_KERNEL_STACK_SIZE;
 
-	task->signal_kernel_stack.sp = pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+	task->signal_kernel_stack.sp = sched_alloc_stack();
 	task->signal_kernel_stack.size = THREAD_KERNEL_STACK_SIZE;
 
 	VECTOR_PUSH(current_task->children, task);
@@ -923,12 +1006,12 @@ void syscall_execve(struct registers *regs) {
 	strcpy(path, _path);
 
 	for(size_t i = 0; i < envp_cnt; i++) {
-		envp[i] = alloc(strlen(_envp[i]));
+		envp[i] = alloc(strlen(_envp[i]) + 1);
 		strcpy(envp[i], _envp[i]);
 	}
 
 	for(size_t i = 0; i < argv_cnt; i++) {
-		argv[i] = alloc(strlen(_argv[i]));
+		argv[i] = alloc(strlen(_argv[i]) + 1);
 		strcpy(argv[i], _argv[i]);
 	}
 
@@ -974,7 +1057,7 @@ void syscall_execve(struct registers *regs) {
 	bool is_suid = vfs_node->stat->st_mode & S_ISUID ? true : false;
 	bool is_sgid = vfs_node->stat->st_mode & S_ISGID ? true : false;
 
-	struct task *task = alloc(sizeof(struct task));
+	struct task *task = slab_cache_alloc(task_cache);
 	sched_default_task(task, current_task->namespace, 0);
 
 	int ret = sched_load_program(task, path);
@@ -1048,6 +1131,14 @@ void syscall_execve(struct registers *regs) {
 	CORE_LOCAL->pid = -1;
 	CORE_LOCAL->tid = -1;
 
+	// the old image is done with, the new task took over the pid
+	vmm_init_page_table(&kernel_mappings);
+	CORE_LOCAL->page_table = &kernel_mappings;
+
+	vmm_put_page_table(current_task->page_table);
+
+	sched_retire_stacks(current_task);
+
 	hash_table_push(&task->namespace->process_list, &task->id.pid, task, sizeof(task->id.pid));
 	VECTOR_PUSH(task_queue, task);
 
@@ -18,6 +18,7 @@
 struct task;
 struct process_group;
 struct session;
+struct cpu_local;
 
 struct pid_namespace {
 	nid_t nid;
@@ -94,6 +95,8 @@ struct task {
 
 	struct program program;
 	struct page_table *page_table;
+
+	struct cpu_local *cpu; // where the task last ran, its kernel stack may still be in use there
 };
 
 struct process_group {
@@ -137,6 +140,7 @@ void reschedule(struct registers *regs, void *ptr);
 void sched_dequeue(struct task *task);
 void sched_requeue(struct task *task);
 void sched_yield();
+void sched_print_stack_stats();
 void sched_initiate_resched();
 void task_terminate(struct task *task, int status);
 void task_stop(struct task *task, int sig);
@@ -3,6 +3,7 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <acpi/madt.h>
+#include <acpi/srat.h>
 #include <int/idt.h>
 #include <int/gdt.h>
 #include <string.h>
@@ -14,6 +15,8 @@ static struct spinlock core_init_lock;
 
 size_t logical_processor_cnt;
 
+typeof(cpu_local_list) cpu_local_list;
+
 static void core_bootstrap(struct cpu_local *cpu_local) {
 	init_cpu_features();
 	gdt_init();
@@ -32,6 +35,7 @@ static void core_bootstrap(struct cpu_local *cpu_local) {
 	asm volatile ("mov %0, %%cr8\nsti" :: "r"(0ull));
 
 	for(;;) {
+		pmm_zero_pool_refill();
 		asm ("hlt");
 	}
 };
@@ -67,11 +71,14 @@ void boot_aps() {
 		*cpu_local = (struct cpu_local) {
 			.kernel_stack = pmm_alloc(2, 1) + HIGH_VMA + 0x2000,
 			.apic_id = madt0->apic_id,
+			.numa_node = numa_apic_node(madt0->apic_id),
 			.pid = -1,
 			.tid = -1,
 			.page_table = &kernel_mappings
 		};
 
+		VECTOR_PUSH(cpu_local_list, cpu_local);
+
 		if(cpu_local->apic_id == (xapic_read(XAPIC_ID_REG_OFF) >> 24)) {
 			wrmsr(MSR_GS_BASE, (uintptr_t)cpu_local);
 			continue;
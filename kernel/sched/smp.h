@@ -1,6 +1,9 @@
 #pragma once
 
 #include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <vector.h>
 #include <types.h>
 
 struct cpu_local {
@@ -11,9 +14,17 @@ struct cpu_local {
 	pid_t pid;
 	tid_t tid;
 	int apic_id;
+	int numa_node;
 	struct page_table *page_table;
+	struct pmm_pcp pcp __attribute__((aligned(8)));
+	struct slab_magazine slab_magazines[SLAB_MAGAZINE_SLOTS] __attribute__((aligned(8)));
+	struct vmm_pcid_cache pcid_cache __attribute__((aligned(8)));
+	struct page_table *active_page_table; // what cr3 points at, may differ from page_table during loads
+	bool tlb_shootdown_pending;
+	uint64_t context_switches __attribute__((aligned(8))); // bumped once the cpu is off the last task's kernel stack
 } __attribute__((packed));
 
 extern size_t logical_processor_cnt;
+extern VECTOR(struct cpu_local*) cpu_local_list;
 
 void boot_aps();